@@ -0,0 +1,425 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace num {
+
+/// alignment of buffers meant for vectorized kernels (one cache line)
+inline constexpr std::size_t bufferAlignment = 64;
+
+/// counters of an Allocator, all zero for allocators that don't cache
+struct AllocatorStats {
+	/// allocations served from the cache
+	std::size_t hits = 0;
+	/// allocations that had to get new memory from the system
+	std::size_t misses = 0;
+	/// bytes in freed blocks kept for reuse
+	std::size_t bytesCached = 0;
+	/// bytes in blocks currently handed out
+	std::size_t bytesInUse = 0;
+};
+
+/// Source of the memory of Tensor storage and gradients.
+/// Every block is aligned to at least bufferAlignment.
+class Allocator {
+public:
+	virtual ~Allocator() = default;
+
+	/// uninitialised block of at least bytes bytes
+	virtual void* allocate(std::size_t bytes) = 0;
+
+	/// give back a block returned by allocate(bytes)
+	virtual void deallocate(void* ptr, std::size_t bytes) noexcept = 0;
+
+	virtual AllocatorStats stats() const
+	{
+		return {};
+	}
+
+	/// return cached blocks to the system
+	virtual void releaseCache()
+	{}
+};
+
+/// allocates and frees every block directly with aligned operator new
+class SystemAllocator : public Allocator {
+public:
+	void* allocate(std::size_t bytes) override
+	{
+		return ::operator new(std::max<std::size_t>(bytes, 1), std::align_val_t{bufferAlignment});
+	}
+
+	void deallocate(void* ptr, std::size_t) noexcept override
+	{
+		::operator delete(ptr, std::align_val_t{bufferAlignment});
+	}
+};
+
+struct CachingAllocatorOptions {
+	/// back blocks of at least hugePageSize bytes with transparent huge pages
+	/// (only has an effect on Linux)
+	bool hugePages = false;
+	/// freed blocks beyond this many cached bytes of a thread
+	/// go to the pool shared by all threads
+	std::size_t maxThreadCachedBytes = std::size_t(64) << 20;
+};
+
+namespace detail {
+
+/// free blocks by block size
+struct FreeLists {
+	std::unordered_map<std::size_t, std::vector<void*>> blocks;
+	std::size_t bytes = 0;
+
+	void* pop(std::size_t blockSize)
+	{
+		auto it = blocks.find(blockSize);
+		if (it == blocks.end() || it->second.empty()) {
+			return nullptr;
+		}
+		void* ptr = it->second.back();
+		it->second.pop_back();
+		bytes -= blockSize;
+		return ptr;
+	}
+
+	void push(void* ptr, std::size_t blockSize)
+	{
+		blocks[blockSize].push_back(ptr);
+		bytes += blockSize;
+	}
+
+	void mergeInto(FreeLists& other)
+	{
+		for (auto& [blockSize, ptrs] : blocks) {
+			std::vector<void*>& dst = other.blocks[blockSize];
+			dst.insert(dst.end(), ptrs.begin(), ptrs.end());
+		}
+		other.bytes += bytes;
+		blocks.clear();
+		bytes = 0;
+	}
+};
+
+struct ThreadCache {
+	/// only contended while releaseCache() runs
+	std::mutex mutex;
+	FreeLists lists;
+};
+
+/// State of a CachingAllocator. Threads that cached blocks of it share
+/// ownership so that their caches can be flushed when they exit.
+class CachePool {
+public:
+	explicit CachePool(const CachingAllocatorOptions& options)
+	  : options (options)
+	{}
+
+	~CachePool()
+	{
+		freeBlocks(shared);
+	}
+
+	CachePool(const CachePool&) = delete;
+	CachePool& operator=(const CachePool&) = delete;
+
+	const CachingAllocatorOptions options;
+	std::atomic<std::size_t> hits {0};
+	std::atomic<std::size_t> misses {0};
+	std::atomic<std::size_t> bytesCached {0};
+	std::atomic<std::size_t> bytesInUse {0};
+
+	static constexpr std::size_t hugePageSize = std::size_t(2) << 20;
+
+	/// size classes: multiples of bufferAlignment up to 256 bytes and
+	/// above that 4 classes between consecutive powers of two,
+	/// which wastes at most 20% of a block
+	static std::size_t blockSize(std::size_t bytes) noexcept
+	{
+		std::size_t step = bufferAlignment;
+		if (bytes > 4 * bufferAlignment) {
+			step = std::bit_floor(bytes - 1) / 4;
+		}
+		return (std::max<std::size_t>(bytes, 1) + step - 1) / step * step;
+	}
+
+	std::align_val_t alignment(std::size_t blockSize) const noexcept
+	{
+		bool huge = options.hugePages && blockSize >= hugePageSize;
+		return std::align_val_t{huge ? hugePageSize : bufferAlignment};
+	}
+
+	void* systemAllocate(std::size_t blockSize)
+	{
+		std::align_val_t align = alignment(blockSize);
+		void* ptr = ::operator new(blockSize, align);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+		if (static_cast<std::size_t>(align) == hugePageSize) {
+			// only a hint, the block works without huge pages as well
+			madvise(ptr, blockSize, MADV_HUGEPAGE);
+		}
+#endif
+		return ptr;
+	}
+
+	void systemFree(void* ptr, std::size_t blockSize) noexcept
+	{
+		::operator delete(ptr, alignment(blockSize));
+	}
+
+	void* popShared(std::size_t blockSize)
+	{
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		return shared.pop(blockSize);
+	}
+
+	void pushShared(void* ptr, std::size_t blockSize)
+	{
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		shared.push(ptr, blockSize);
+	}
+
+	void registerCache(ThreadCache* cache)
+	{
+		std::lock_guard<std::mutex> lock(cachesMutex);
+		caches.push_back(cache);
+	}
+
+	/// hand the blocks of an exiting thread to the shared pool
+	void retireCache(ThreadCache* cache)
+	{
+		{
+			std::lock_guard<std::mutex> lock(cachesMutex);
+			std::erase(caches, cache);
+		}
+		FreeLists blocks;
+		{
+			std::lock_guard<std::mutex> lock(cache->mutex);
+			cache->lists.mergeInto(blocks);
+		}
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		blocks.mergeInto(shared);
+	}
+
+	void releaseAll()
+	{
+		{
+			std::lock_guard<std::mutex> lock(cachesMutex);
+			for (ThreadCache* cache : caches) {
+				std::lock_guard<std::mutex> cacheLock(cache->mutex);
+				freeBlocks(cache->lists);
+			}
+		}
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		freeBlocks(shared);
+	}
+private:
+	std::mutex sharedMutex;
+	FreeLists shared;
+	std::mutex cachesMutex;
+	std::vector<ThreadCache*> caches;
+
+	void freeBlocks(FreeLists& lists) noexcept
+	{
+		for (auto& [blockSize, ptrs] : lists.blocks) {
+			for (void* ptr : ptrs) {
+				systemFree(ptr, blockSize);
+			}
+		}
+		bytesCached -= lists.bytes;
+		lists.blocks.clear();
+		lists.bytes = 0;
+	}
+};
+
+/// caches of the current thread, flushed into their pools on thread exit
+class ThreadCaches {
+public:
+	~ThreadCaches()
+	{
+		exited = true;
+		for (auto& [pool, cache] : caches) {
+			pool->retireCache(cache.get());
+		}
+	}
+
+	ThreadCache& get(const std::shared_ptr<CachePool>& pool)
+	{
+		// usually there is only a single allocator
+		for (auto& [owner, cache] : caches) {
+			if (owner == pool) {
+				return *cache;
+			}
+		}
+		auto& [owner, cache] = caches.emplace_back(pool, std::make_unique<ThreadCache>());
+		pool->registerCache(cache.get());
+		return *cache;
+	}
+
+	/// nullptr once the caches of the thread were flushed on its exit
+	static ThreadCaches* current()
+	{
+		if (exited) {
+			return nullptr;
+		}
+		static thread_local ThreadCaches threadCaches;
+		return &threadCaches;
+	}
+private:
+	static inline thread_local bool exited = false;
+
+	std::vector<std::pair<std::shared_ptr<CachePool>, std::unique_ptr<ThreadCache>>> caches;
+};
+
+} // namespace detail
+
+/// Thread-caching allocator with size classes.
+/// Freed blocks are kept in a cache of the freeing thread (up to
+/// maxThreadCachedBytes, beyond that in a pool shared by all threads)
+/// and handed out again for any request of the same size class, so a
+/// training loop allocating the same shapes every step stops calling
+/// into the system allocator after the first step.
+class CachingAllocator : public Allocator {
+public:
+	explicit CachingAllocator(const CachingAllocatorOptions& options = {})
+	  : pool (std::make_shared<detail::CachePool>(options))
+	{}
+
+	void* allocate(std::size_t bytes) override
+	{
+		std::size_t blockSize = detail::CachePool::blockSize(bytes);
+		void* ptr = nullptr;
+		if (detail::ThreadCaches* caches = detail::ThreadCaches::current()) {
+			detail::ThreadCache& cache = caches->get(pool);
+			std::lock_guard<std::mutex> lock(cache.mutex);
+			ptr = cache.lists.pop(blockSize);
+		}
+		if (!ptr) {
+			ptr = pool->popShared(blockSize);
+		}
+		if (ptr) {
+			pool->hits.fetch_add(1, std::memory_order_relaxed);
+			pool->bytesCached.fetch_sub(blockSize, std::memory_order_relaxed);
+		} else {
+			ptr = pool->systemAllocate(blockSize);
+			pool->misses.fetch_add(1, std::memory_order_relaxed);
+		}
+		pool->bytesInUse.fetch_add(blockSize, std::memory_order_relaxed);
+		return ptr;
+	}
+
+	void deallocate(void* ptr, std::size_t bytes) noexcept override
+	{
+		std::size_t blockSize = detail::CachePool::blockSize(bytes);
+		pool->bytesInUse.fetch_sub(blockSize, std::memory_order_relaxed);
+		pool->bytesCached.fetch_add(blockSize, std::memory_order_relaxed);
+		try {
+			if (detail::ThreadCaches* caches = detail::ThreadCaches::current()) {
+				detail::ThreadCache& cache = caches->get(pool);
+				std::lock_guard<std::mutex> lock(cache.mutex);
+				if (cache.lists.bytes + blockSize <= pool->options.maxThreadCachedBytes) {
+					cache.lists.push(ptr, blockSize);
+					return;
+				}
+			}
+		} catch (...) {
+			// without room in the cache the block goes to the shared pool
+		}
+		try {
+			pool->pushShared(ptr, blockSize);
+		} catch (...) {
+			pool->bytesCached.fetch_sub(blockSize, std::memory_order_relaxed);
+			pool->systemFree(ptr, blockSize);
+		}
+	}
+
+	AllocatorStats stats() const override
+	{
+		return {
+			pool->hits.load(std::memory_order_relaxed),
+			pool->misses.load(std::memory_order_relaxed),
+			pool->bytesCached.load(std::memory_order_relaxed),
+			pool->bytesInUse.load(std::memory_order_relaxed)};
+	}
+
+	/// free the cached blocks of all threads, blocks in use stay valid
+	void releaseCache() override
+	{
+		pool->releaseAll();
+	}
+private:
+	std::shared_ptr<detail::CachePool> pool;
+};
+
+namespace detail {
+// installed allocators are never destroyed so that buffers
+// may outlive a switch to another allocator
+inline std::mutex allocatorMutex;
+inline auto* installedAllocators = new std::vector<std::shared_ptr<Allocator>>();
+inline std::atomic<Allocator*> currentAllocator {nullptr};
+/// set while autofn::Profiler runs (it is the flag Profiler::isEnabled()
+/// checks), allocations are only counted meanwhile
+inline std::atomic<bool> profilerEnabled {false};
+/// bytes of buffers the current thread allocated while profiling
+inline thread_local std::uint64_t threadAllocatedBytes = 0;
+} // namespace detail
+
+/// Allocator used for all Tensor buffers allocated from now on.
+/// It is a CachingAllocator unless another one was set.
+inline Allocator& allocator()
+{
+	if (Allocator* current = detail::currentAllocator.load(std::memory_order_acquire)) {
+		return *current;
+	}
+	std::lock_guard<std::mutex> lock(detail::allocatorMutex);
+	if (!detail::currentAllocator.load(std::memory_order_relaxed)) {
+		detail::installedAllocators->push_back(std::make_shared<CachingAllocator>());
+		detail::currentAllocator.store(detail::installedAllocators->back().get(), std::memory_order_release);
+	}
+	return *detail::currentAllocator.load(std::memory_order_relaxed);
+}
+
+/// Use alloc for all Tensor buffers allocated from now on. Buffers
+/// allocated before are still returned to the allocator they came from.
+inline void setAllocator(std::shared_ptr<Allocator> alloc)
+{
+	std::lock_guard<std::mutex> lock(detail::allocatorMutex);
+	detail::installedAllocators->push_back(std::move(alloc));
+	detail::currentAllocator.store(detail::installedAllocators->back().get(), std::memory_order_release);
+}
+
+/// zero initialised buffer of size elements from the current
+/// allocator, aligned to bufferAlignment
+template <typename T>
+std::shared_ptr<T[]> makeAlignedBuffer(std::size_t size)
+{
+	Allocator& alloc = allocator();
+	std::size_t bytes = size * sizeof(T);
+	T* ptr = static_cast<T*>(alloc.allocate(bytes));
+	if (detail::profilerEnabled.load(std::memory_order_relaxed)) {
+		detail::threadAllocatedBytes += bytes;
+	}
+	std::uninitialized_value_construct_n(ptr, size);
+	return std::shared_ptr<T[]>(ptr, [&alloc, bytes](T* p) {
+		alloc.deallocate(p, bytes);
+	});
+}
+
+} // namespace num
+
+#endif
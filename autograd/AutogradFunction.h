@@ -1,28 +1,25 @@
 #ifndef AUTOGRAD_FUNCTION_H
 #define AUTOGRAD_FUNCTION_H
 
+#include <algorithm>
+#include <cstddef>
+#include <functional>
 #include <initializer_list>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <vector>
 
 #include "Tensor.h"
+#include "GradMode.h"
+#include "Function.h"
+#include "Expr.h"
+#include "Broadcast.h"
+#include "Gemm.h"
+#include "Reduce.h"
 
 namespace autofn {
 
-
-template <num::num_t T, typename Derived>
-class Function {
-public:
-	static num::Tensor<T> apply(std::initializer_list<num::Tensor<T>> args)
-	{
-		std::vector<num::Tensor<T>> inputs(args);
-		num::Tensor<T> out = Derived::forward(inputs);
-		out.gradGraphChildren = inputs;
-		out.backwardFn = Derived::backward;
-		return out;
-	}
-};
-
-
 template <num::num_t T>
 class Add : public Function<T, Add<T>> {
 public:
@@ -42,8 +39,12 @@ public:
 
 	static void backward(const num::Tensor<T>& outGradient, std::vector<num::Tensor<T>> oldInputs)
 	{
-		oldInputs[0].setBroadcastGradient(outGradient);
-		oldInputs[1].setBroadcastGradient(outGradient);
+		if (oldInputs[0].requiresGrad()) {
+			oldInputs[0].setBroadcastGradient(outGradient);
+		}
+		if (oldInputs[1].requiresGrad()) {
+			oldInputs[1].setBroadcastGradient(outGradient);
+		}
 	}
 };
 template <num::num_t T>
@@ -64,8 +65,12 @@ public:
 
 	static void backward(const num::Tensor<T>& outGradient, std::vector<num::Tensor<T>> oldInputs)
 	{
-		oldInputs[0].setBroadcastGradient(outGradient);
-		oldInputs[1].setBroadcastGradient(num::Tensor<T>(-1) * outGradient);
+		if (oldInputs[0].requiresGrad()) {
+			oldInputs[0].setBroadcastGradient(outGradient);
+		}
+		if (oldInputs[1].requiresGrad()) {
+			oldInputs[1].setBroadcastGradient(num::Tensor<T>(-1) * outGradient);
+		}
 	}
 };
 template <num::num_t T>
@@ -86,8 +91,12 @@ public:
 
 	static void backward(const num::Tensor<T>& outGradient, std::vector<num::Tensor<T>> oldInputs)
 	{
-		oldInputs[0].setBroadcastGradient(oldInputs[1] * outGradient);
-		oldInputs[1].setBroadcastGradient(oldInputs[0] * outGradient);
+		if (oldInputs[0].requiresGrad()) {
+			oldInputs[0].setBroadcastGradient(oldInputs[1] * outGradient);
+		}
+		if (oldInputs[1].requiresGrad()) {
+			oldInputs[1].setBroadcastGradient(oldInputs[0] * outGradient);
+		}
 	}
 };
 
@@ -110,8 +119,12 @@ public:
 
 	static void backward(const num::Tensor<T>& outGradient, std::vector<num::Tensor<T>> oldInputs)
 	{
-		oldInputs[0].setBroadcastGradient(outGradient / oldInputs[1]);
-		oldInputs[1].setBroadcastGradient((num::Tensor<T>(-1) * oldInputs[0]) * oldInputs[1].pow(-2) * outGradient);
+		if (oldInputs[0].requiresGrad()) {
+			oldInputs[0].setBroadcastGradient(outGradient / oldInputs[1]);
+		}
+		if (oldInputs[1].requiresGrad()) {
+			oldInputs[1].setBroadcastGradient((num::Tensor<T>(-1) * oldInputs[0]) * oldInputs[1].pow(-2) * outGradient);
+		}
 	}
 };
 
@@ -143,7 +156,9 @@ public:
 
 	static void backward(const num::Tensor<T>& outGradient, std::vector<num::Tensor<T>> oldInputs)
 	{
-		oldInputs[0].setBroadcastGradient(outGradient * forward({oldInputs[0], oldInputs[1] - num::Tensor<T>(1)}) * oldInputs[1]);
+		if (oldInputs[0].requiresGrad()) {
+			oldInputs[0].setBroadcastGradient(outGradient * forward({oldInputs[0], oldInputs[1] - num::Tensor<T>(1)}) * oldInputs[1]);
+		}
 	}
 };
 
@@ -160,37 +175,124 @@ public:
 
 	static num::Tensor<T> forward(const std::vector<num::Tensor<T>>& args)
 	{
-		if (args.at(0).dims.size() != 2 || args.at(1).dims.size() != 2) {
+		const num::Tensor<T>& a = args.at(0);
+		const num::Tensor<T>& b = args.at(1);
+		if (a.dims.size() != 2 || b.dims.size() != 2) {
 			throw num::ShapeMismatchError("dot product only defined for 2d arrays");
 		}
+		if (a.dims.at(1) != b.dims.at(0)) {
+			throw num::ShapeMismatchError("can't multiply matrices of shapes "
+				+ a.dims.toString() + " and " + b.dims.toString());
+		}
 
-		num::Tensor<T> out({args.at(0).dims.at(0), args.at(1).dims.at(1)});
+		num::Tensor<T> out({a.dims.at(0), b.dims.at(1)});
+		num::gemm(
+			a.dims.at(0), b.dims.at(1), a.dims.at(1),
+			a.data(), a.strides.at(0), a.strides.at(1),
+			b.data(), b.strides.at(0), b.strides.at(1),
+			out.data(), out.strides.at(0), out.strides.at(1));
+		return out;
+	}
+
+	static void backward(const num::Tensor<T>& outGradient, std::vector<num::Tensor<T>> oldInputs)
+	{
+		// the transposes are views so gemm reads them with swapped strides
+		if (oldInputs[0].requiresGrad()) {
+			oldInputs[0].setBroadcastGradient(forward({outGradient, oldInputs[1].transpose()}));
+		}
+		if (oldInputs[1].requiresGrad()) {
+			oldInputs[1].setBroadcastGradient(forward({oldInputs[0].transpose(), outGradient}));
+		}
+	}
+};
+
+template <num::num_t T>
+inline constexpr MatMul<T> mm {};
+
+/// matrix product over the last two dimensions of both operands.
+/// The leading (batch) dimensions are broadcast, e.g. [B,M,K] x [K,N]
+/// multiplies every one of the B matrices with the same [K,N] matrix.
+template <num::num_t T>
+class BatchMatMul : public Function<T, BatchMatMul<T>> {
+public:
+	static num::Tensor<T> operator()(const num::Tensor<T>& a, const num::Tensor<T>& b)
+	{
+		return Function<T, BatchMatMul<T>>::apply({a, b});
+	}
+
+	static num::Tensor<T> forward(const std::vector<num::Tensor<T>>& args)
+	{
+		const num::Tensor<T>& a = args.at(0);
+		const num::Tensor<T>& b = args.at(1);
+		int aRank = a.dims.size();
+		int bRank = b.dims.size();
+		if (aRank < 2 || bRank < 2) {
+			throw num::ShapeMismatchError("batched matrix product needs at least 2d arrays");
+		}
+		int M = a.dims.at(aRank - 2);
+		int K = a.dims.at(aRank - 1);
+		int N = b.dims.at(bRank - 1);
+		if (b.dims.at(bRank - 2) != K) {
+			throw num::ShapeMismatchError("can't multiply matrices of shapes "
+				+ a.dims.toString() + " and " + b.dims.toString());
+		}
 
-		for (int i = 0; i < out.dims.at(0); i++) {
-			for (int j = 0; j < out.dims.at(1); j++) {
-				T outVal = 0;
-				for (int k = 0; k < args.at(0).dims.at(1); k++) {
-					outVal += args.at(0).getSingle({i, k}) * args.at(1).getSingle({k, j});
+		num::IntArrRef aBatchDims(a.dims.data(), aRank - 2);
+		num::IntArrRef bBatchDims(b.dims.data(), bRank - 2);
+		num::IntArrRef batchDims = num::broadcastShape(aBatchDims, bBatchDims);
+		num::IntArrRef aBatchStrides = num::broadcastStrides(
+			aBatchDims, num::IntArrRef(a.strides.data(), aRank - 2), batchDims);
+		num::IntArrRef bBatchStrides = num::broadcastStrides(
+			bBatchDims, num::IntArrRef(b.strides.data(), bRank - 2), batchDims);
+
+		num::IntArrRef outDims = batchDims.pad(batchDims.size() + 2);
+		std::copy(batchDims.begin(), batchDims.end(), outDims.begin());
+		outDims[batchDims.size()] = M;
+		outDims[batchDims.size() + 1] = N;
+		num::Tensor<T> out(outDims);
+
+		int batchSize = 1;
+		for (int dim : batchDims) {
+			batchSize *= dim;
+		}
+		// one GEMM per thread if there are enough matrices,
+		// otherwise let every GEMM use all threads itself
+		int grainSize = (batchSize >= num::numThreads()) ? 1 : batchSize;
+		num::parallelFor(0, batchSize, grainSize, [&](std::ptrdiff_t begin, std::ptrdiff_t end) {
+			for (std::ptrdiff_t batch = begin; batch < end; ++batch) {
+				std::ptrdiff_t aOffset = 0;
+				std::ptrdiff_t bOffset = 0;
+				std::ptrdiff_t rest = batch;
+				for (int d = batchDims.size() - 1; d >= 0; --d) {
+					int idx = rest % batchDims[d];
+					rest /= batchDims[d];
+					aOffset += idx * aBatchStrides[d];
+					bOffset += idx * bBatchStrides[d];
 				}
-				out.setSingle(outVal, {i, j});
+				num::gemm(
+					M, N, K,
+					a.data() + aOffset, a.strides.at(aRank - 2), a.strides.at(aRank - 1),
+					b.data() + bOffset, b.strides.at(bRank - 2), b.strides.at(bRank - 1),
+					out.data() + batch * M * N, N, 1);
 			}
-		}
+		});
 		return out;
 	}
 
 	static void backward(const num::Tensor<T>& outGradient, std::vector<num::Tensor<T>> oldInputs)
 	{
-		// std::cout << "start" << std::endl;
-		// std::cout << forward({oldInputs[0].transpose(), outGradient}).toString() << std::endl;
-		// std::cout << forward({outGradient, oldInputs[1].transpose()}).toString() << std::endl;
-		// std::cout << "end" << std::endl;
-		oldInputs[0].setBroadcastGradient(forward({outGradient, oldInputs[1].transpose()}));
-		oldInputs[1].setBroadcastGradient(forward({oldInputs[0].transpose(), outGradient}));
+		// setBroadcastGradient sums over the broadcast batch dimensions
+		if (oldInputs[0].requiresGrad()) {
+			oldInputs[0].setBroadcastGradient(forward({outGradient, oldInputs[1].transpose(-2, -1)}));
+		}
+		if (oldInputs[1].requiresGrad()) {
+			oldInputs[1].setBroadcastGradient(forward({oldInputs[0].transpose(-2, -1), outGradient}));
+		}
 	}
 };
 
 template <num::num_t T>
-inline constexpr MatMul<T> mm {};
+inline constexpr BatchMatMul<T> bmm {};
 
 template <num::num_t T>
 class Transpose : public Function<T, Transpose<T>> {
@@ -210,20 +312,15 @@ public:
 		if (args.at(0).dims.size() != 2) {
 			throw num::ShapeMismatchError("transpose only defined for 2d arrays");
 		}
-		num::Tensor<T> out(args.at(0).clone());
-		out.dims = num::IntArrRef({args.at(0).dims.at(1), args.at(0).dims.at(0)});
-		for (int i = 0; i < args.at(0).dims.at(0); ++i) {
-			for (int j = 0; j < args.at(0).dims.at(1); ++j) {
-				T val = args.at(0).getSingle({i, j});
-				out.setSingle(val, {j, i});
-			}
-		}
-		return out;
+		// view sharing the contents of the operand
+		return args.at(0).transpose();
 	}
 
 	static void backward(const num::Tensor<T>& outGradient, std::vector<num::Tensor<T>> oldInputs)
 	{
-		oldInputs[0].setBroadcastGradient(forward({outGradient}));
+		if (oldInputs[0].requiresGrad()) {
+			oldInputs[0].setBroadcastGradient(outGradient.transpose());
+		}
 	}
 };
 
@@ -245,14 +342,22 @@ public:
 		if (args.size() != 1) {
 			throw std::invalid_argument("sigmoid needs exactly one argument");
 		}
-		num::Tensor<T> one(1);
-		return one / (one + (one / args[0].exp()));
+		return lazyForward(args[0]);
 	}
 
 	static void backward(const num::Tensor<T>& outGradient, std::vector<num::Tensor<T>> oldInputs)
 	{
-		num::Tensor<T> out = forward(oldInputs);
-		oldInputs[0].setBroadcastGradient(out * outGradient * (num::Tensor<T>(1) - out));
+		if (oldInputs[0].requiresGrad()) {
+			// recomputes the output in the same loop instead of storing it
+			auto out = lazyForward(oldInputs[0]);
+			oldInputs[0].setBroadcastGradient(out * outGradient * (T(1) - out));
+		}
+	}
+private:
+	/// fused into a single loop, see num::expr
+	static auto lazyForward(const num::Tensor<T>& x)
+	{
+		return T(1) / (T(1) + T(1) / num::expr::exp(num::lazy(x)));
 	}
 };
 
@@ -272,19 +377,419 @@ public:
 		if (args.size() != 1) {
 			throw std::invalid_argument("ReLU needs exactly one argument");
 		}
-		return (args[0].clone().applyUnary([](T val) {return (val > 0) ? val : 0;}));
+		return num::expr::relu(num::lazy(args[0]));
 	}
 
 	static void backward(const num::Tensor<T>& outGradient, std::vector<num::Tensor<T>> oldInputs)
 	{
-		num::Tensor<T> gradient = oldInputs[0].clone().applyUnary([](T val) {return (val > 0) ? 1 : 0;}) * outGradient;
-		oldInputs[0].setBroadcastGradient(gradient);
+		if (oldInputs[0].requiresGrad()) {
+			oldInputs[0].setBroadcastGradient((num::lazy(oldInputs[0]) > T(0)) * outGradient);
+		}
 	}
 };
 
 
 template <num::num_t T>
 inline constexpr ReLU<T> relu {};
+
+/// activation applied by autofn::linear to its result
+enum class Activation {
+	none,
+	relu,
+	sigmoid
+};
+
+/// Fully connected layer activation(x·wᵀ + b) for x of shape [N, in],
+/// w of shape [out, in] and an optional bias b of shape [out].
+/// w is read transposed through its strides, the bias and activation are
+/// applied in the epilogue of the GEMM and the layer is a single node of
+/// the autograd graph whose backward pass computes the gradients of x, w
+/// and b together, accumulating them straight into their buffers.
+template <num::num_t T>
+class Linear {
+public:
+	static num::Tensor<T> operator()(
+		const num::Tensor<T>& x, const num::Tensor<T>& w, const num::Tensor<T>& b,
+		Activation activation = Activation::none)
+	{
+		return apply({x, w, b}, activation);
+	}
+
+	static num::Tensor<T> operator()(
+		const num::Tensor<T>& x, const num::Tensor<T>& w, Activation activation = Activation::none)
+	{
+		return apply({x, w}, activation);
+	}
+private:
+	template <Activation activation>
+	struct Epilogue {
+		const T* bias;
+		int biasStride;
+
+		T operator()(int, int j, T val) const noexcept
+		{
+			if (bias) {
+				val += bias[j * biasStride];
+			}
+			if constexpr (activation == Activation::relu) {
+				return val > T(0) ? val : T(0);
+			} else if constexpr (activation == Activation::sigmoid) {
+				return T(1) / (T(1) + std::exp(-val));
+			} else {
+				return val;
+			}
+		}
+	};
+
+	static num::Tensor<T> apply(std::vector<num::Tensor<T>> inputs, Activation activation)
+	{
+		const num::Tensor<T>& x = inputs[0];
+		const num::Tensor<T>& w = inputs[1];
+		if (x.dims.size() != 2 || w.dims.size() != 2) {
+			throw num::ShapeMismatchError("linear layer needs 2d input and weight");
+		}
+		if (x.dims[1] != w.dims[1]) {
+			throw num::ShapeMismatchError("can't apply linear layer with weight of shape "
+				+ w.dims.toString() + " to input of shape " + x.dims.toString());
+		}
+		if (inputs.size() > 2 && inputs[2].dims != num::IntArrRef{w.dims[0]}) {
+			throw num::ShapeMismatchError("bias of linear layer with weight of shape "
+				+ w.dims.toString() + " can't have shape " + inputs[2].dims.toString());
+		}
+
+		num::Tensor<T> out = profiledForward<T>("Linear", inputs, [&inputs, activation]() {
+			return tracedForward<T>(inputs, [activation](const std::vector<num::Tensor<T>>& in) {
+				switch (activation) {
+				case Activation::relu:
+					return forward<Activation::relu>(in);
+				case Activation::sigmoid:
+					return forward<Activation::sigmoid>(in);
+				default:
+					return forward<Activation::none>(in);
+				}
+			});
+		});
+		// the derivative of the activation is computed from the output
+		// which the detached view sees without referencing the graph
+		recordOperation<T>(out,
+			[activation, result = out.detach()](const num::Tensor<T>& outGradient, const std::vector<num::Tensor<T>>& oldInputs) {
+				backward(outGradient, oldInputs, result, activation);
+			}, std::move(inputs), "Linear");
+		return out;
+	}
+
+	template <Activation activation>
+	static num::Tensor<T> forward(const std::vector<num::Tensor<T>>& args)
+	{
+		const num::Tensor<T>& x = args[0];
+		const num::Tensor<T>& w = args[1];
+		num::Tensor<T> out({x.dims[0], w.dims[0]});
+		Epilogue<activation> epilogue {nullptr, 0};
+		if (args.size() > 2) {
+			epilogue = {args[2].data(), args[2].strides[0]};
+		}
+		num::gemm(
+			x.dims[0], w.dims[0], x.dims[1],
+			x.data(), x.strides[0], x.strides[1],
+			w.data(), w.strides[1], w.strides[0],
+			out.data(), out.strides[0], out.strides[1], false, epilogue);
+		return out;
+	}
+
+	static void backward(
+		const num::Tensor<T>& outGradient, const std::vector<num::Tensor<T>>& oldInputs,
+		const num::Tensor<T>& result, Activation activation)
+	{
+		// gradient before the activation
+		num::Tensor<T> gradient = outGradient;
+		if (activation == Activation::relu) {
+			gradient = (num::lazy(result) > T(0)) * outGradient;
+		} else if (activation == Activation::sigmoid) {
+			gradient = num::lazy(result) * outGradient * (T(1) - num::lazy(result));
+		}
+
+		num::Tensor<T> x = oldInputs[0];
+		num::Tensor<T> w = oldInputs[1];
+		int N = x.dims[0];
+		int in = x.dims[1];
+		int out = w.dims[0];
+		const T* g = gradient.data();
+		int rsG = gradient.strides[0];
+		int csG = gradient.strides[1];
+		// dx = g·w, dw = gᵀ·x, db = sum of the rows of g
+		x.accumulateGradient([&](T* dx) {
+			num::gemm(N, in, out, g, rsG, csG, w.data(), w.strides[0], w.strides[1], dx, in, 1, true);
+		});
+		w.accumulateGradient([&](T* dw) {
+			num::gemm(out, in, N, g, csG, rsG, x.data(), x.strides[0], x.strides[1], dw, in, 1, true);
+		});
+		if (oldInputs.size() > 2) {
+			num::Tensor<T> b = oldInputs[2];
+			b.accumulateGradient([&](T* db) {
+				// summed in acc_t so rows of narrow types don't vanish in a large sum
+				std::vector<num::acc_t<T>> sums(db, db + out);
+				for (int i = 0; i < N; ++i) {
+					const T* gRow = g + i * rsG;
+					for (int j = 0; j < out; ++j) {
+						sums[j] += static_cast<num::acc_t<T>>(gRow[j * csG]);
+					}
+				}
+				std::ranges::copy(sums, db);
+			});
+		}
+	}
+};
+
+template <num::num_t T>
+inline constexpr Linear<T> linear {};
+
+namespace detail {
+
+/// shapes involved in reducing a Tensor of shape dims over axes
+/// (all of them if axes is empty)
+struct ReductionShape {
+	/// dims with the reduced axes set to 1
+	num::IntArrRef keptDims;
+	/// shape of the result: keptDims or keptDims without the reduced axes
+	num::IntArrRef outDims;
+	/// strides of a contiguous result of shape keptDims as seen from
+	/// the operand, i.e. 0 along the reduced axes
+	num::IntArrRef outStrides;
+	/// number of elements reduced into every element of the result
+	std::ptrdiff_t count = 1;
+
+	ReductionShape(const num::IntArrRef& dims, const num::IntArrRef& axes, bool keepdim)
+	  : keptDims (dims.clone())
+	{
+		std::vector<bool> reduced(dims.size(), axes.size() == 0);
+		for (int axis : axes) {
+			int dim = (axis >= 0) ? axis : axis + dims.size();
+			if (dim < 0 || dim >= dims.size()) {
+				throw num::IndexError("can't reduce axis " + std::to_string(axis)
+					+ " of Tensor with shape " + dims.toString());
+			}
+			if (reduced[dim]) {
+				throw std::invalid_argument("axis " + std::to_string(axis) + " is reduced twice");
+			}
+			reduced[dim] = true;
+		}
+
+		std::vector<int> remaining;
+		for (int i = 0; i < dims.size(); ++i) {
+			if (reduced[i]) {
+				count *= dims[i];
+				keptDims[i] = 1;
+			} else {
+				remaining.push_back(dims[i]);
+			}
+		}
+		outStrides = num::Tensor<int>::contiguousStrides(keptDims);
+		for (int i = 0; i < dims.size(); ++i) {
+			if (reduced[i]) {
+				outStrides[i] = 0;
+			}
+		}
+		if (keepdim) {
+			outDims = keptDims.clone();
+		} else if (remaining.empty()) {
+			outDims = num::IntArrRef{1};
+		} else {
+			outDims = num::IntArrRef(remaining);
+		}
+	}
+};
+
+/// sum over the reduction, divided by the number of summed elements for the mean
+template <num::num_t T>
+num::Tensor<T> sumReduction(const num::Tensor<T>& operand, const ReductionShape& shape, bool mean)
+{
+	num::Tensor<T> out(shape.keptDims);
+	num::reduceSumInto(
+		out.data(), shape.outStrides, out.size(),
+		operand.data(), operand.dims, operand.strides);
+	if (mean) {
+		num::acc_t<T> count = shape.count;
+		out.applyUnary([count](T val) {return val / count;});
+	}
+	return out.reshape(shape.outDims);
+}
+
+/// maximum (better = std::greater) or minimum (std::less) of operand over
+/// the reduction. indices receives the row-major index of every selected element.
+template <num::num_t T, typename Better>
+num::Tensor<T> selectReduction(
+	const num::Tensor<T>& operand, const ReductionShape& shape, Better better,
+	std::vector<std::ptrdiff_t>& indices)
+{
+	if (operand.size() == 0) {
+		throw std::invalid_argument("can't select an element of an empty Tensor");
+	}
+	num::Tensor<T> out(shape.keptDims);
+	indices.resize(out.size());
+	num::reduceSelectInto(
+		out.data(), indices.data(), shape.outStrides, out.size(),
+		operand.data(), operand.dims, operand.strides,
+		num::Tensor<T>::contiguousStrides(operand.dims), better);
+	return out.reshape(shape.outDims);
+}
+
+/// maximum or minimum over axes whose gradient only flows
+/// to the selected elements
+template <num::num_t T, typename Better>
+num::Tensor<T> differentiableSelect(const char* name, const num::Tensor<T>& operand, const num::IntArrRef& axes, bool keepdim)
+{
+	ReductionShape shape(operand.dims, axes, keepdim);
+	// shared with the backward function, replays of a StaticGraph update it
+	auto indices = std::make_shared<std::vector<std::ptrdiff_t>>();
+	std::vector<num::Tensor<T>> inputs {operand};
+	num::Tensor<T> out = profiledForward<T>(name, inputs, [&inputs, &shape, &indices]() {
+		return tracedForward<T>(inputs, [shape, indices](const std::vector<num::Tensor<T>>& in) {
+			return selectReduction(in[0], shape, Better{}, *indices);
+		});
+	});
+	recordOperation<T>(out,
+		[indices](const num::Tensor<T>& outGradient, const std::vector<num::Tensor<T>>& oldInputs) {
+			num::Tensor<T> input = oldInputs[0];
+			num::Tensor<T> gradient(input.dims);
+			num::Tensor<T> outGrad = outGradient.contiguous();
+			T* gradVals = gradient.data();
+			const T* outGradVals = outGrad.data();
+			for (std::size_t i = 0; i < indices->size(); ++i) {
+				gradVals[(*indices)[i]] += outGradVals[i];
+			}
+			input.setGradient(gradient);
+		}, std::move(inputs), name);
+	return out;
+}
+
+/// index along axis (or the flat index without an axis) of the
+/// elements selected by better. The indices are stored in acc_t<T>,
+/// bfloat16 couldn't represent indices above 256 exactly.
+template <num::num_t T, typename Better>
+num::Tensor<num::acc_t<T>> argSelect(const num::Tensor<T>& operand, std::optional<int> axis, bool keepdim)
+{
+	num::IntArrRef axes;
+	if (axis) {
+		axes = num::IntArrRef{*axis};
+	}
+	ReductionShape shape(operand.dims, axes, keepdim);
+	std::vector<std::ptrdiff_t> indices;
+	num::Tensor<T> selected = selectReduction(operand, shape, Better{}, indices);
+	int dim = -1;
+	if (axis) {
+		dim = (*axis >= 0) ? *axis : *axis + operand.dims.size();
+	}
+	num::IntArrRef linearStrides = num::Tensor<T>::contiguousStrides(operand.dims);
+	num::Tensor<num::acc_t<T>> out(selected.dims);
+	num::acc_t<T>* vals = out.data();
+	for (std::size_t i = 0; i < indices.size(); ++i) {
+		std::ptrdiff_t idx = indices[i];
+		if (dim >= 0) {
+			idx = (idx / linearStrides[dim]) % operand.dims[dim];
+		}
+		vals[i] = static_cast<num::acc_t<T>>(idx);
+	}
+	out.setRequiresGrad(false);
+	return out;
+}
+
+} // namespace detail
+
+/// sum over the given axes (all of them if there are none). The reduced
+/// dimensions are kept with size 1 if keepdim is set and removed otherwise.
+template <num::num_t T>
+class Sum {
+public:
+	static num::Tensor<T> operator()(const num::Tensor<T>& operand, const num::IntArrRef& axes = {}, bool keepdim = false)
+	{
+		detail::ReductionShape shape(operand.dims, axes, keepdim);
+		std::vector<num::Tensor<T>> inputs {operand};
+		num::Tensor<T> out = profiledForward<T>("Sum", inputs, [&inputs, &shape]() {
+			return tracedForward<T>(inputs, [shape](const std::vector<num::Tensor<T>>& in) {
+				return detail::sumReduction(in[0], shape, false);
+			});
+		});
+		recordOperation<T>(out,
+			[keptDims = shape.keptDims](const num::Tensor<T>& outGradient, const std::vector<num::Tensor<T>>& oldInputs) {
+				num::Tensor<T> input = oldInputs[0];
+				input.setGradient(outGradient.reshape(keptDims).expand(input.dims));
+			}, std::move(inputs), "Sum");
+		return out;
+	}
+};
+
+template <num::num_t T>
+inline constexpr Sum<T> sum {};
+
+/// mean over the given axes, see Sum
+template <num::num_t T>
+class Mean {
+public:
+	static num::Tensor<T> operator()(const num::Tensor<T>& operand, const num::IntArrRef& axes = {}, bool keepdim = false)
+	{
+		detail::ReductionShape shape(operand.dims, axes, keepdim);
+		std::vector<num::Tensor<T>> inputs {operand};
+		num::Tensor<T> out = profiledForward<T>("Mean", inputs, [&inputs, &shape]() {
+			return tracedForward<T>(inputs, [shape](const std::vector<num::Tensor<T>>& in) {
+				return detail::sumReduction(in[0], shape, true);
+			});
+		});
+		num::acc_t<T> count = shape.count;
+		recordOperation<T>(out,
+			[keptDims = shape.keptDims, count](const num::Tensor<T>& outGradient, const std::vector<num::Tensor<T>>& oldInputs) {
+				num::Tensor<T> input = oldInputs[0];
+				num::Tensor<T> gradient = outGradient.clone().applyUnary([count](T val) {return val / count;});
+				input.setGradient(gradient.reshape(keptDims).expand(input.dims));
+			}, std::move(inputs), "Mean");
+		return out;
+	}
+};
+
+template <num::num_t T>
+inline constexpr Mean<T> mean {};
+
+/// maximum over the given axes, see Sum. The gradient flows to the first
+/// maximal element of every reduced group.
+template <num::num_t T>
+class Max {
+public:
+	static num::Tensor<T> operator()(const num::Tensor<T>& operand, const num::IntArrRef& axes = {}, bool keepdim = false)
+	{
+		return detail::differentiableSelect<T, std::greater<T>>("Max", operand, axes, keepdim);
+	}
+};
+
+template <num::num_t T>
+inline constexpr Max<T> max {};
+
+/// minimum over the given axes, see Max
+template <num::num_t T>
+class Min {
+public:
+	static num::Tensor<T> operator()(const num::Tensor<T>& operand, const num::IntArrRef& axes = {}, bool keepdim = false)
+	{
+		return detail::differentiableSelect<T, std::less<T>>("Min", operand, axes, keepdim);
+	}
+};
+
+template <num::num_t T>
+inline constexpr Min<T> min {};
+
+/// index of the (first) maximum along axis or the flat index of the
+/// maximum of all elements if no axis is given, in acc_t<T> (float for
+/// bfloat16). Not differentiable.
+template <num::num_t T>
+num::Tensor<num::acc_t<T>> argmax(const num::Tensor<T>& operand, std::optional<int> axis = std::nullopt, bool keepdim = false)
+{
+	return detail::argSelect<T, std::greater<T>>(operand, axis, keepdim);
+}
+
+/// index of the (first) minimum, see argmax
+template <num::num_t T>
+num::Tensor<num::acc_t<T>> argmin(const num::Tensor<T>& operand, std::optional<int> axis = std::nullopt, bool keepdim = false)
+{
+	return detail::argSelect<T, std::less<T>>(operand, axis, keepdim);
+}
 } // namespace autofn
 
 #endif
\ No newline at end of file
@@ -0,0 +1,124 @@
+#ifndef BFLOAT16_H
+#define BFLOAT16_H
+
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+namespace num {
+
+/// 16 bit brain floating point number: the upper half of a float, i.e. the
+/// same exponent range with 8 bits of precision. Tensors of it take a
+/// quarter of the memory (and bandwidth) of double Tensors.
+/// It converts implicitly to float and from every arithmetic type so the
+/// generic kernels work on it, and arithmetic happens in float. Matrix
+/// products, reductions and the optimizers accumulate in acc_t<bfloat16>,
+/// i.e. float, and only round the results to bfloat16.
+struct bfloat16 {
+	std::uint16_t bits = 0;
+
+	constexpr bfloat16() = default;
+
+	/// rounds to the nearest bfloat16, ties to even
+	constexpr bfloat16(float val) noexcept
+	  : bits (roundFromFloat(val))
+	{}
+
+	template <typename U> requires (std::is_arithmetic_v<U> && !std::is_same_v<U, float>)
+	constexpr bfloat16(U val) noexcept
+	  : bfloat16(static_cast<float>(val))
+	{}
+
+	constexpr operator float() const noexcept
+	{
+		return std::bit_cast<float>(static_cast<std::uint32_t>(bits) << 16);
+	}
+
+	static constexpr bfloat16 fromBits(std::uint16_t bits) noexcept
+	{
+		bfloat16 out;
+		out.bits = bits;
+		return out;
+	}
+
+	constexpr bfloat16 operator-() const noexcept
+	{
+		return fromBits(bits ^ 0x8000);
+	}
+
+	constexpr bfloat16& operator+=(float other) noexcept
+	{
+		return *this = static_cast<float>(*this) + other;
+	}
+
+	constexpr bfloat16& operator-=(float other) noexcept
+	{
+		return *this = static_cast<float>(*this) - other;
+	}
+
+	constexpr bfloat16& operator*=(float other) noexcept
+	{
+		return *this = static_cast<float>(*this) * other;
+	}
+
+	constexpr bfloat16& operator/=(float other) noexcept
+	{
+		return *this = static_cast<float>(*this) / other;
+	}
+private:
+	static constexpr std::uint16_t roundFromFloat(float val) noexcept
+	{
+		std::uint32_t u = std::bit_cast<std::uint32_t>(val);
+		// keep NaNs NaN (rounding could turn them into infinity)
+		if ((u & 0x7fffffffu) > 0x7f800000u) {
+			return static_cast<std::uint16_t>((u >> 16) | 0x40);
+		}
+		u += 0x7fffu + ((u >> 16) & 1);
+		return static_cast<std::uint16_t>(u >> 16);
+	}
+};
+
+/// type that sums and products of T are accumulated in
+template <typename T>
+struct AccumulatorType {
+	using type = T;
+};
+
+template <>
+struct AccumulatorType<bfloat16> {
+	using type = float;
+};
+
+template <typename T>
+using acc_t = typename AccumulatorType<T>::type;
+
+/// std::is_floating_point including bfloat16
+template <typename T>
+inline constexpr bool isFloatingPoint = std::is_floating_point_v<T> || std::is_same_v<T, bfloat16>;
+
+} // namespace num
+
+template <>
+class std::numeric_limits<num::bfloat16> {
+public:
+	static constexpr bool is_specialized = true;
+	static constexpr bool is_signed = true;
+	static constexpr bool is_integer = false;
+	static constexpr bool is_exact = false;
+	static constexpr bool has_infinity = true;
+	static constexpr bool has_quiet_NaN = true;
+	static constexpr int digits = 8;
+	static constexpr int radix = 2;
+	static constexpr int min_exponent = -125;
+	static constexpr int max_exponent = 128;
+
+	static constexpr num::bfloat16 min() noexcept {return num::bfloat16::fromBits(0x0080);}
+	static constexpr num::bfloat16 max() noexcept {return num::bfloat16::fromBits(0x7f7f);}
+	static constexpr num::bfloat16 lowest() noexcept {return num::bfloat16::fromBits(0xff7f);}
+	static constexpr num::bfloat16 epsilon() noexcept {return num::bfloat16::fromBits(0x3c00);}
+	static constexpr num::bfloat16 infinity() noexcept {return num::bfloat16::fromBits(0x7f80);}
+	static constexpr num::bfloat16 quiet_NaN() noexcept {return num::bfloat16::fromBits(0x7fc0);}
+};
+
+#endif
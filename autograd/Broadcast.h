@@ -0,0 +1,115 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <array>
+#include <cstddef>
+
+#include "Tensor.h"
+#include "IntArrRef.h"
+#include "NumErrors.h"
+#include "LoopPlan.h"
+#include "Parallel.h"
+
+namespace num {
+
+/// shape that two Tensors of shapes a and b are broadcast to.
+/// Like in NumPy the shapes are aligned at the last dimension and
+/// every pair of dimensions needs to be equal or one of them 1.
+inline IntArrRef broadcastShape(const IntArrRef& a, const IntArrRef& b)
+{
+	int outSize = std::max(a.size(), b.size());
+	IntArrRef padA = a.pad(outSize);
+	IntArrRef padB = b.pad(outSize);
+	IntArrRef out(outSize);
+	for (int i = 0; i < outSize; ++i) {
+		if (padA[i] != padB[i] && padA[i] != 1 && padB[i] != 1) {
+			throw ShapeMismatchError{"can't broadcast shapes together: "
+				+ a.toString() + " and " + b.toString()};
+		}
+		out[i] = (padA[i] == 1) ? padB[i] : padA[i];
+	}
+	return out;
+}
+
+/// strides to read a Tensor with the given dims and strides as if it had
+/// shape outDims: broadcast dimensions get stride 0
+inline IntArrRef broadcastStrides(const IntArrRef& dims, const IntArrRef& strides, const IntArrRef& outDims)
+{
+	IntArrRef out(outDims.size(), 0);
+	int numDimsDiff = outDims.size() - dims.size();
+	for (int i = 0; i < dims.size(); ++i) {
+		if (dims[i] == outDims[i + numDimsDiff]) {
+			out[i + numDimsDiff] = strides[i];
+		} else if (dims[i] != 1) {
+			throw ShapeMismatchError{"can't broadcast shape " + dims.toString()
+				+ " to " + outDims.toString()};
+		}
+	}
+	return out;
+}
+
+/// Inner loop of binary element-wise operations.
+/// Unit and zero strides (tensor-tensor, tensor-scalar and the rows of
+/// vector-matrix broadcasts) get their own loops so that the compiler
+/// can vectorize them.
+template <typename T, typename Fn>
+inline void binaryRowKernel(
+	T* __restrict out,
+	const T* __restrict a, int strideA,
+	const T* __restrict b, int strideB,
+	int n, Fn fn)
+{
+	if (strideA == 1 && strideB == 1) {
+		for (int i = 0; i < n; ++i) {
+			out[i] = fn(a[i], b[i]);
+		}
+	} else if (strideA == 1 && strideB == 0) {
+		const T valB = *b;
+		for (int i = 0; i < n; ++i) {
+			out[i] = fn(a[i], valB);
+		}
+	} else if (strideA == 0 && strideB == 1) {
+		const T valA = *a;
+		for (int i = 0; i < n; ++i) {
+			out[i] = fn(valA, b[i]);
+		}
+	} else {
+		for (int i = 0; i < n; ++i) {
+			out[i] = fn(a[i * strideA], b[i * strideB]);
+		}
+	}
+}
+
+/// apply fn element-wise to a and b broadcast to a common shape
+template <num_t T>
+Tensor<T> applyBinaryWithBroadcast(const Tensor<T>& a, const Tensor<T>& b, auto fn)
+{
+	IntArrRef outDims = broadcastShape(a.dims, b.dims);
+	Tensor<T> out(outDims);
+	if (out.size() == 0) {
+		return out;
+	}
+
+	LoopPlan<3> plan(outDims, {
+		out.strides,
+		broadcastStrides(a.dims, a.strides, outDims),
+		broadcastStrides(b.dims, b.strides, outDims)
+	});
+
+	T* outArr = out.data();
+	const T* aArr = a.data();
+	const T* bArr = b.data();
+	plan.parallelForEachRow(defaultGrainSize, [&](const std::array<std::ptrdiff_t, 3>& offsets, int n, const std::array<int, 3>& innerStrides) {
+		// out is freshly allocated and therefore contiguous
+		binaryRowKernel(
+			outArr + offsets[0],
+			aArr + offsets[1], innerStrides[1],
+			bArr + offsets[2], innerStrides[2],
+			n, fn);
+	});
+	return out;
+}
+
+} // namespace num
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <functional>
+#include <vector>
+
+#include "Tensor.h"
+#include "GradMode.h"
+
+namespace autofn {
+
+template <num::num_t T>
+using SegmentFn = std::function<num::Tensor<T>(const std::vector<num::Tensor<T>>&)>;
+
+/// Activation checkpointing: computes fn(inputs) without recording the
+/// intermediate results of fn. The output becomes a single node of the
+/// autograd graph that only keeps the inputs. Its backward function runs
+/// fn again with grad mode enabled to rebuild the local graph and
+/// propagates the gradient through it, which accumulates the gradients of
+/// the inputs and of every parameter used by fn.
+/// fn needs to compute the same result when called again.
+template <num::num_t T>
+num::Tensor<T> checkpoint(SegmentFn<T> fn, std::vector<num::Tensor<T>> inputs)
+{
+	if (!GradMode::isEnabled()) {
+		return fn(inputs);
+	}
+
+	num::Tensor<T> out = [&fn, &inputs]() {
+		NoGradGuard noGrad;
+		return fn(inputs);
+	}();
+
+	// fn may use parameters requiring a gradient so the node
+	// is recorded even if none of the inputs requires one
+	out.setGradFn(
+		[fn](const num::Tensor<T>& outGradient, const std::vector<num::Tensor<T>>& oldInputs) {
+			std::vector<num::Tensor<T>> segmentInputs;
+			for (const num::Tensor<T>& input : oldInputs) {
+				num::Tensor<T> segmentInput = input.detach();
+				segmentInput.setRequiresGrad(input.requiresGrad());
+				segmentInputs.push_back(segmentInput);
+			}
+
+			GradModeGuard enableGrad(true);
+			num::Tensor<T> segmentOut = fn(segmentInputs);
+			if (!segmentOut.requiresGrad()) {
+				return;
+			}
+			segmentOut.backward(outGradient);
+
+			NoGradGuard noGrad;
+			for (size_t i = 0; i < oldInputs.size(); ++i) {
+				if (oldInputs[i].requiresGrad() && segmentInputs[i].gradData()) {
+					num::Tensor<T> input = oldInputs[i];
+					input.setGradient(segmentInputs[i].getGradient());
+				}
+			}
+		},
+		std::move(inputs), "Checkpoint");
+	return out;
+}
+
+} // namespace autofn
+
+#endif
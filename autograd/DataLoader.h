@@ -0,0 +1,336 @@
+#ifndef DATA_LOADER_H
+#define DATA_LOADER_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Tensor.h"
+#include "Storage.h"
+#include "NumErrors.h"
+
+namespace data {
+
+struct DataLoaderOptions {
+	int batchSize = 32;
+	/// visit the samples in a new random order every epoch
+	bool shuffle = true;
+	/// skip the last batch of an epoch if it isn't full
+	bool dropLast = false;
+	/// background threads gathering batches,
+	/// 0 gathers every batch when it is needed
+	int numWorkers = 1;
+	/// number of batches gathered ahead of the one in use
+	int prefetch = 2;
+	/// seed of the shuffling, random if not set
+	std::optional<unsigned> seed = std::nullopt;
+};
+
+/// Mini-batches of samples along the first dimension of one or more
+/// Tensors (e.g. inputs and targets) with the same number of samples.
+///
+/// Every batch is a vector with one contiguous Tensor per dataset Tensor
+/// holding the samples of the batch. They are gathered with one copy per
+/// run of consecutive samples, i.e. a single copy without shuffling.
+/// Background workers gather the next prefetch batches while the current
+/// one is used, into buffers that are allocated once and reused for later
+/// batches unless a Tensor of an earlier batch still references them.
+///
+///     for (const std::vector<num::Tensor<double>>& batch : loader) {
+///         num::Tensor<double> loss = lossFn(model.forward(batch[0]), batch[1]);
+///     }
+///
+/// Starting a new loop over the loader starts a new epoch (and abandons
+/// the previous one if it was left early).
+template <num::num_t T>
+class DataLoader {
+public:
+	using Batch = std::vector<num::Tensor<T>>;
+
+	DataLoader(const num::Tensor<T>& dataset, const DataLoaderOptions& options = {})
+	  : DataLoader(std::vector<num::Tensor<T>>{dataset}, options)
+	{}
+
+	DataLoader(const std::vector<num::Tensor<T>>& datasets, const DataLoaderOptions& options = {})
+	  : options (options),
+		engine (options.seed ? *options.seed : std::random_device{}())
+	{
+		if (datasets.empty()) {
+			throw std::invalid_argument("DataLoader needs at least one Tensor");
+		}
+		if (options.batchSize < 1 || options.numWorkers < 0 || options.prefetch < 1) {
+			throw std::invalid_argument("DataLoader needs a positive batch size and prefetch "
+				"and a non-negative number of workers");
+		}
+		numSamples = datasets[0].dims[0];
+		for (const num::Tensor<T>& dataset : datasets) {
+			if (dataset.dims[0] != numSamples) {
+				throw num::ShapeMismatchError("all Tensors of a DataLoader need " + std::to_string(numSamples)
+					+ " samples but got shape " + dataset.dims.toString());
+			}
+			// samples are copied as whole rows
+			this->datasets.push_back(dataset.detach().contiguous());
+		}
+		order.resize(numSamples);
+		std::iota(order.begin(), order.end(), 0);
+
+		int numSlots = (options.numWorkers > 0) ? options.prefetch + 1 : 1;
+		for (int i = 0; i < numSlots; ++i) {
+			slots.push_back(std::make_unique<Slot>());
+		}
+		for (int i = 0; i < options.numWorkers; ++i) {
+			workers.emplace_back([this]() {workerLoop();});
+		}
+	}
+
+	~DataLoader()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			++epoch;
+		}
+		changed.notify_all();
+		// the jthreads are joined before the members they use are destroyed
+		workers.clear();
+	}
+
+	DataLoader(const DataLoader&) = delete;
+	DataLoader& operator=(const DataLoader&) = delete;
+
+	/// number of batches per epoch
+	int size() const noexcept
+	{
+		if (options.dropLast) {
+			return numSamples / options.batchSize;
+		}
+		return (numSamples + options.batchSize - 1) / options.batchSize;
+	}
+
+	class Iterator {
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = Batch;
+		using difference_type = std::ptrdiff_t;
+
+		const Batch& operator*() const
+		{
+			return *batch;
+		}
+
+		const Batch* operator->() const
+		{
+			return batch;
+		}
+
+		Iterator& operator++()
+		{
+			batch = loader->fetch(++idx);
+			return *this;
+		}
+
+		void operator++(int)
+		{
+			++*this;
+		}
+
+		bool operator==(std::default_sentinel_t) const noexcept
+		{
+			return batch == nullptr;
+		}
+	private:
+		friend class DataLoader;
+		DataLoader* loader;
+		int idx;
+		const Batch* batch;
+
+		Iterator(DataLoader* loader)
+		  : loader (loader), idx (0), batch (loader->fetch(0))
+		{}
+	};
+
+	/// start a new epoch
+	Iterator begin()
+	{
+		startEpoch();
+		return Iterator(this);
+	}
+
+	std::default_sentinel_t end() const noexcept
+	{
+		return {};
+	}
+private:
+	/// buffers of a batch, batches are assigned to slots round robin
+	struct Slot {
+		std::vector<std::shared_ptr<T[]>> buffers;
+		Batch batch;
+		/// the next batch this slot takes
+		int expected = 0;
+		bool filling = false;
+		bool ready = false;
+		std::exception_ptr error;
+	};
+
+	DataLoaderOptions options;
+	std::vector<num::Tensor<T>> datasets;
+	int numSamples;
+	std::mt19937 engine;
+	std::vector<int> order;
+
+	std::vector<std::unique_ptr<Slot>> slots;
+	std::mutex mutex;
+	std::condition_variable changed;
+	/// batches of the current epoch not yet taken by a worker start here
+	int nextToGather = 0;
+	int numBatches = 0;
+	/// incremented with every epoch so that workers drop stale batches
+	int epoch = 0;
+	bool stopping = false;
+	// declared last so that they are joined before everything else is destroyed
+	std::vector<std::jthread> workers;
+
+	void startEpoch()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		++epoch;
+		numBatches = 0;
+		// a batch of an abandoned epoch may still be gathered
+		changed.wait(lock, [this]() {
+			return std::ranges::none_of(slots, [](const auto& slot) {return slot->filling;});
+		});
+		if (options.shuffle) {
+			std::shuffle(order.begin(), order.end(), engine);
+		}
+		numBatches = size();
+		nextToGather = 0;
+		for (size_t i = 0; i < slots.size(); ++i) {
+			slots[i]->expected = i;
+			slots[i]->ready = false;
+			slots[i]->error = nullptr;
+		}
+		lock.unlock();
+		changed.notify_all();
+	}
+
+	/// batch idx of the current epoch or nullptr past its end. The batch
+	/// before it is given back, so its slot may be refilled from now on.
+	const Batch* fetch(int idx)
+	{
+		if (idx > 0) {
+			Slot& prev = *slots[(idx - 1) % slots.size()];
+			std::lock_guard<std::mutex> lock(mutex);
+			prev.ready = false;
+			prev.expected = idx - 1 + slots.size();
+		}
+		changed.notify_all();
+		if (idx >= numBatches) {
+			return nullptr;
+		}
+
+		Slot& slot = *slots[idx % slots.size()];
+		if (options.numWorkers == 0) {
+			gather(slot, idx);
+			return &slot.batch;
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&slot]() {return slot.ready;});
+		if (slot.error) {
+			std::rethrow_exception(slot.error);
+		}
+		return &slot.batch;
+	}
+
+	void workerLoop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			int idx = -1;
+			int workerEpoch = epoch;
+			changed.wait(lock, [&]() {
+				if (stopping) {
+					return true;
+				}
+				workerEpoch = epoch;
+				if (nextToGather < numBatches) {
+					Slot& slot = *slots[nextToGather % slots.size()];
+					if (slot.expected == nextToGather && !slot.ready && !slot.filling) {
+						idx = nextToGather;
+						return true;
+					}
+				}
+				return false;
+			});
+			if (stopping) {
+				return;
+			}
+
+			++nextToGather;
+			Slot& slot = *slots[idx % slots.size()];
+			slot.filling = true;
+			lock.unlock();
+			std::exception_ptr error;
+			try {
+				gather(slot, idx);
+			} catch (...) {
+				error = std::current_exception();
+			}
+			lock.lock();
+			slot.filling = false;
+			// batches of an abandoned epoch are dropped
+			if (workerEpoch == epoch) {
+				slot.error = error;
+				slot.ready = true;
+			}
+			changed.notify_all();
+		}
+	}
+
+	/// copy the samples of batch idx into the buffers of slot
+	void gather(Slot& slot, int idx)
+	{
+		int begin = idx * options.batchSize;
+		int count = std::min(options.batchSize, numSamples - begin);
+		slot.buffers.resize(datasets.size());
+		slot.batch.clear();
+		for (size_t d = 0; d < datasets.size(); ++d) {
+			const num::Tensor<T>& dataset = datasets[d];
+			size_t sampleSize = (numSamples > 0) ? dataset.size() / numSamples : 0;
+			std::shared_ptr<T[]>& buffer = slot.buffers[d];
+			// a Tensor of an earlier batch still using the buffer keeps it
+			if (!buffer || buffer.use_count() > 1) {
+				buffer = num::makeAlignedBuffer<T>(options.batchSize * sampleSize);
+			}
+			const T* src = dataset.data();
+			T* dst = buffer.get();
+			// runs of consecutive samples (all of them without shuffling)
+			// are copied at once
+			for (int k = 0; k < count;) {
+				int run = 1;
+				while (k + run < count && order[begin + k + run] == order[begin + k] + run) {
+					++run;
+				}
+				std::copy_n(src + order[begin + k] * sampleSize, run * sampleSize, dst + k * sampleSize);
+				k += run;
+			}
+			num::IntArrRef batchDims = dataset.dims.clone();
+			batchDims[0] = count;
+			slot.batch.push_back(num::Tensor<T>::fromBuffer(batchDims, buffer));
+		}
+	}
+};
+
+} // namespace data
+
+#endif
@@ -0,0 +1,572 @@
+#ifndef EXPR_H
+#define EXPR_H
+
+#include <array>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+#include <vector>
+
+#include "Tensor.h"
+#include "IntArrRef.h"
+#include "Broadcast.h"
+#include "LoopPlan.h"
+#include "Parallel.h"
+#include "Function.h"
+
+namespace num {
+
+/// Lazy element-wise expressions.
+/// Operators on expressions only build a tree of nodes whose structure
+/// is known at compile time. Converting the tree to a Tensor evaluates
+/// it in a single loop over the elements without intermediate Tensors
+/// and records one node in the autograd graph whose backward pass
+/// computes the gradients of all inputs in a single loop as well:
+///
+///     num::Tensor<double> y = num::expr::exp(-num::lazy(x)) * w + 1.0;
+///
+/// Every node knows the index of its first leaf (First) so that a value
+/// and gradient per leaf can be passed around in plain arrays.
+namespace expr {
+
+template <typename E>
+Tensor<typename E::value_type> evaluate(const E& e);
+
+/// base of all expression nodes
+template <typename Derived, num_t T>
+struct Expr {
+	using value_type = T;
+
+	/// evaluate the expression into a new Tensor
+	Tensor<T> eval() const
+	{
+		return evaluate(static_cast<const Derived&>(*this));
+	}
+
+	operator Tensor<T>() const
+	{
+		return eval();
+	}
+};
+
+template <typename E>
+concept Expression = requires {
+	typename E::value_type;
+	{E::numLeaves} -> std::convertible_to<int>;
+} && std::derived_from<E, Expr<E, typename E::value_type>>;
+
+/// Tensor taking part in an expression
+template <num_t T>
+struct Leaf : Expr<Leaf<T>, T> {
+	static constexpr int numLeaves = 1;
+	Tensor<T> tensor;
+
+	explicit Leaf(Tensor<T> tensor)
+	  : tensor (std::move(tensor))
+	{}
+
+	template <int First>
+	T value(const T* leafVals) const
+	{
+		return leafVals[First];
+	}
+
+	template <int First>
+	void backprop(const T*, T upstream, T* leafGrads) const
+	{
+		leafGrads[First] += upstream;
+	}
+
+	void collect(std::vector<Tensor<T>>& leaves) const
+	{
+		leaves.push_back(tensor);
+	}
+
+	/// same expression without references to the autograd graph
+	Leaf<T> detach() const
+	{
+		return Leaf<T>(tensor.detach());
+	}
+};
+
+/// constant broadcast to every element
+template <num_t T>
+struct Scalar : Expr<Scalar<T>, T> {
+	static constexpr int numLeaves = 0;
+	T val;
+
+	explicit Scalar(T val)
+	  : val (val)
+	{}
+
+	template <int First>
+	T value(const T*) const
+	{
+		return val;
+	}
+
+	template <int First>
+	void backprop(const T*, T, T*) const
+	{}
+
+	void collect(std::vector<Tensor<T>>&) const
+	{}
+
+	Scalar<T> detach() const
+	{
+		return *this;
+	}
+};
+
+template <typename Op, Expression E>
+struct Unary : Expr<Unary<Op, E>, typename E::value_type> {
+	using value_type = typename E::value_type;
+	static constexpr int numLeaves = E::numLeaves;
+	E operand;
+
+	explicit Unary(E operand)
+	  : operand (std::move(operand))
+	{}
+
+	template <int First>
+	value_type value(const value_type* leafVals) const
+	{
+		return Op::apply(operand.template value<First>(leafVals));
+	}
+
+	template <int First>
+	void backprop(const value_type* leafVals, value_type upstream, value_type* leafGrads) const
+	{
+		value_type x = operand.template value<First>(leafVals);
+		operand.template backprop<First>(leafVals, Op::derivative(x, upstream), leafGrads);
+	}
+
+	void collect(std::vector<Tensor<value_type>>& leaves) const
+	{
+		operand.collect(leaves);
+	}
+
+	Unary<Op, E> detach() const
+	{
+		return Unary<Op, E>(operand.detach());
+	}
+};
+
+template <typename Op, Expression L, Expression R>
+struct Binary : Expr<Binary<Op, L, R>, typename L::value_type> {
+	using value_type = typename L::value_type;
+	static constexpr int numLeaves = L::numLeaves + R::numLeaves;
+	L lhs;
+	R rhs;
+
+	Binary(L lhs, R rhs)
+	  : lhs (std::move(lhs)), rhs (std::move(rhs))
+	{}
+
+	template <int First>
+	value_type value(const value_type* leafVals) const
+	{
+		return Op::apply(
+			lhs.template value<First>(leafVals),
+			rhs.template value<First + L::numLeaves>(leafVals));
+	}
+
+	template <int First>
+	void backprop(const value_type* leafVals, value_type upstream, value_type* leafGrads) const
+	{
+		if constexpr (Op::differentiable) {
+			value_type a = lhs.template value<First>(leafVals);
+			value_type b = rhs.template value<First + L::numLeaves>(leafVals);
+			// constants don't need their derivative
+			if constexpr (L::numLeaves > 0) {
+				lhs.template backprop<First>(leafVals, Op::lhsDerivative(a, b, upstream), leafGrads);
+			}
+			if constexpr (R::numLeaves > 0) {
+				rhs.template backprop<First + L::numLeaves>(leafVals, Op::rhsDerivative(a, b, upstream), leafGrads);
+			}
+		}
+	}
+
+	void collect(std::vector<Tensor<value_type>>& leaves) const
+	{
+		lhs.collect(leaves);
+		rhs.collect(leaves);
+	}
+
+	Binary<Op, L, R> detach() const
+	{
+		return Binary<Op, L, R>(lhs.detach(), rhs.detach());
+	}
+};
+
+/// element-wise operations: the value and its derivatives
+/// multiplied with the upstream gradient
+namespace ops {
+
+struct Add {
+	static constexpr bool differentiable = true;
+	template <typename T> static T apply(T a, T b) {return a + b;}
+	template <typename T> static T lhsDerivative(T, T, T up) {return up;}
+	template <typename T> static T rhsDerivative(T, T, T up) {return up;}
+};
+
+struct Sub {
+	static constexpr bool differentiable = true;
+	template <typename T> static T apply(T a, T b) {return a - b;}
+	template <typename T> static T lhsDerivative(T, T, T up) {return up;}
+	template <typename T> static T rhsDerivative(T, T, T up) {return -up;}
+};
+
+struct Mul {
+	static constexpr bool differentiable = true;
+	template <typename T> static T apply(T a, T b) {return a * b;}
+	template <typename T> static T lhsDerivative(T, T b, T up) {return up * b;}
+	template <typename T> static T rhsDerivative(T a, T, T up) {return up * a;}
+};
+
+struct Div {
+	static constexpr bool differentiable = true;
+	template <typename T> static T apply(T a, T b) {return a / b;}
+	template <typename T> static T lhsDerivative(T, T b, T up) {return up / b;}
+	template <typename T> static T rhsDerivative(T a, T b, T up) {return -up * a / (b * b);}
+};
+
+struct Pow {
+	static constexpr bool differentiable = true;
+	template <typename T> static T apply(T a, T b) {return std::pow(a, b);}
+	template <typename T> static T lhsDerivative(T a, T b, T up) {return up * b * std::pow(a, b - 1);}
+	template <typename T> static T rhsDerivative(T a, T b, T up) {return up * std::pow(a, b) * std::log(a);}
+};
+
+/// 1 where compare(a, b) holds and 0 elsewhere, without gradient
+template <typename Compare>
+struct Comparison {
+	static constexpr bool differentiable = false;
+	template <typename T> static T apply(T a, T b) {return Compare{}(a, b) ? T(1) : T(0);}
+};
+
+struct Neg {
+	template <typename T> static T apply(T x) {return -x;}
+	template <typename T> static T derivative(T, T up) {return -up;}
+};
+
+struct Exp {
+	template <typename T> static T apply(T x) {return std::exp(x);}
+	template <typename T> static T derivative(T x, T up) {return up * std::exp(x);}
+};
+
+struct Log {
+	template <typename T> static T apply(T x) {return std::log(x);}
+	template <typename T> static T derivative(T x, T up) {return up / x;}
+};
+
+struct ReLU {
+	template <typename T> static T apply(T x) {return (x > 0) ? x : T(0);}
+	template <typename T> static T derivative(T x, T up) {return (x > 0) ? up : T(0);}
+};
+
+} // namespace ops
+
+namespace detail {
+
+template <typename A, typename B>
+struct ValueTypeOf {
+	using type = typename B::value_type;
+};
+
+template <Expression A, typename B>
+struct ValueTypeOf<A, B> {
+	using type = typename A::value_type;
+};
+
+/// things that can be combined with an expression of value type T
+template <typename X, typename T>
+concept Operand = Expression<X> || std::same_as<X, Tensor<T>> || std::same_as<X, T> || std::is_arithmetic_v<X>;
+
+/// operands of a binary operator of which at least one is an expression
+template <typename A, typename B>
+concept BinaryOperands = (Expression<A> || Expression<B>)
+	&& Operand<A, typename ValueTypeOf<A, B>::type>
+	&& Operand<B, typename ValueTypeOf<A, B>::type>;
+
+template <num_t T, typename X>
+auto asExpr(const X& x)
+{
+	if constexpr (Expression<X>) {
+		return x;
+	} else if constexpr (std::same_as<X, Tensor<T>>) {
+		return Leaf<T>(x);
+	} else {
+		return Scalar<T>(static_cast<T>(x));
+	}
+}
+
+template <typename Op, typename A, typename B>
+auto makeBinary(const A& a, const B& b)
+{
+	using T = typename ValueTypeOf<A, B>::type;
+	auto lhs = asExpr<T>(a);
+	auto rhs = asExpr<T>(b);
+	return Binary<Op, decltype(lhs), decltype(rhs)>(std::move(lhs), std::move(rhs));
+}
+
+/// calls fn(vals, j) for the elements j of a row of the operands
+/// [first, first + N) of a LoopPlan where vals holds the values of
+/// all N leaves. Rows with unit strides get their own loop so that the
+/// compiler can vectorize it.
+template <num_t T, int N, size_t M, typename Fn>
+inline void forEachLeafValue(
+	const std::array<const T*, N>& leafData, const std::array<std::ptrdiff_t, M>& offsets,
+	const std::array<int, M>& innerStrides, int first, int n, const Fn& fn)
+{
+	std::array<const T*, N> rows;
+	bool unit = true;
+	for (int k = 0; k < N; ++k) {
+		rows[k] = leafData[k] + offsets[first + k];
+		unit = unit && innerStrides[first + k] == 1;
+	}
+	T vals[N];
+	if (unit) {
+		for (int j = 0; j < n; ++j) {
+			for (int k = 0; k < N; ++k) {
+				vals[k] = rows[k][j];
+			}
+			fn(vals, j);
+		}
+	} else {
+		for (int j = 0; j < n; ++j) {
+			for (int k = 0; k < N; ++k) {
+				vals[k] = rows[k][j * innerStrides[first + k]];
+			}
+			fn(vals, j);
+		}
+	}
+}
+
+/// accumulate the gradients of all leaves of e given the gradient of its
+/// value in one loop over the elements. Leaves are summed over the
+/// dimensions they were broadcast along.
+template <typename E>
+void backward(const E& e, const Tensor<typename E::value_type>& outGradient, std::vector<Tensor<typename E::value_type>> leaves)
+{
+	using T = typename E::value_type;
+	constexpr int N = E::numLeaves;
+	const IntArrRef& outDims = outGradient.dims;
+
+	// one gradient per leaf in the shape of the output
+	std::vector<Tensor<T>> grads;
+	std::array<T*, N> gradArrs {};
+	for (int k = 0; k < N; ++k) {
+		if (leaves[k].requiresGrad()) {
+			grads.emplace_back(outDims);
+			gradArrs[k] = grads.back().data();
+		}
+	}
+	if (grads.empty() || outGradient.size() == 0) {
+		return;
+	}
+
+	std::array<IntArrRef, N + 2> strides;
+	std::array<const T*, N> leafData;
+	strides[0] = Tensor<T>::contiguousStrides(outDims);
+	strides[1] = outGradient.strides;
+	for (int k = 0; k < N; ++k) {
+		strides[k + 2] = broadcastStrides(leaves[k].dims, leaves[k].strides, outDims);
+		leafData[k] = leaves[k].data();
+	}
+	LoopPlan<N + 2> plan(outDims, strides);
+	const T* outGradArr = outGradient.data();
+	plan.parallelForEachRow(defaultGrainSize, [&](const std::array<std::ptrdiff_t, N + 2>& offsets, int n, const std::array<int, N + 2>& innerStrides) {
+		const T* upstream = outGradArr + offsets[1];
+		forEachLeafValue<T, N>(leafData, offsets, innerStrides, 2, n, [&](const T* vals, int j) {
+			T leafGrads[N] = {};
+			e.template backprop<0>(vals, upstream[j * innerStrides[1]], leafGrads);
+			std::ptrdiff_t o = offsets[0] + static_cast<std::ptrdiff_t>(j) * innerStrides[0];
+			for (int k = 0; k < N; ++k) {
+				if (gradArrs[k]) {
+					gradArrs[k][o] = leafGrads[k];
+				}
+			}
+		});
+	});
+
+	auto grad = grads.begin();
+	for (int k = 0; k < N; ++k) {
+		if (gradArrs[k]) {
+			leaves[k].setBroadcastGradient(*grad++);
+		}
+	}
+}
+
+} // namespace detail
+
+namespace detail {
+
+/// values of e for the given leaves (in the order of collect) in a new
+/// Tensor of the shape they broadcast to, computed in a single loop
+template <typename E>
+Tensor<typename E::value_type> forward(const E& e, const std::vector<Tensor<typename E::value_type>>& leaves)
+{
+	using T = typename E::value_type;
+	constexpr int N = E::numLeaves;
+	IntArrRef outDims = leaves[0].dims;
+	for (int k = 1; k < N; ++k) {
+		outDims = broadcastShape(outDims, leaves[k].dims);
+	}
+
+	Tensor<T> out(outDims);
+	if (out.size() == 0) {
+		return out;
+	}
+	std::array<IntArrRef, N + 1> strides;
+	std::array<const T*, N> leafData;
+	strides[0] = out.strides;
+	for (int k = 0; k < N; ++k) {
+		strides[k + 1] = broadcastStrides(leaves[k].dims, leaves[k].strides, outDims);
+		leafData[k] = leaves[k].data();
+	}
+	LoopPlan<N + 1> plan(outDims, strides);
+	T* outArr = out.data();
+	plan.parallelForEachRow(defaultGrainSize, [&](const std::array<std::ptrdiff_t, N + 1>& offsets, int n, const std::array<int, N + 1>& innerStrides) {
+		// out is freshly allocated and therefore contiguous
+		T* outRow = outArr + offsets[0];
+		forEachLeafValue<T, N>(leafData, offsets, innerStrides, 1, n, [&](const T* vals, int j) {
+			outRow[j] = e.template value<0>(vals);
+		});
+	});
+	return out;
+}
+
+} // namespace detail
+
+/// Evaluate e into a new Tensor of the shape all leaves broadcast to
+/// in a single loop. If any leaf requires a gradient the result is
+/// recorded as one node in the autograd graph (see autofn::recordOperation).
+template <typename E>
+Tensor<typename E::value_type> evaluate(const E& e)
+{
+	using T = typename E::value_type;
+	static_assert(E::numLeaves > 0, "expression needs at least one Tensor");
+
+	std::vector<Tensor<T>> leaves;
+	leaves.reserve(E::numLeaves);
+	e.collect(leaves);
+	// the leaves are passed separately so the expression itself
+	// doesn't need to reference the autograd graph
+	auto fused = e.detach();
+	Tensor<T> out = autofn::profiledForward<T>("FusedExpr", leaves, [&leaves, &fused]() {
+		return autofn::tracedForward<T>(leaves, [fused](const std::vector<Tensor<T>>& in) {
+			return detail::forward(fused, in);
+		});
+	});
+	autofn::recordOperation<T>(out,
+		[fused](const Tensor<T>& outGradient, const std::vector<Tensor<T>>& inputs) {
+			detail::backward(fused, outGradient, inputs);
+		}, std::move(leaves), "FusedExpr");
+	return out;
+}
+
+template <typename A, typename B> requires detail::BinaryOperands<A, B>
+auto operator+(const A& a, const B& b)
+{
+	return detail::makeBinary<ops::Add>(a, b);
+}
+
+template <typename A, typename B> requires detail::BinaryOperands<A, B>
+auto operator-(const A& a, const B& b)
+{
+	return detail::makeBinary<ops::Sub>(a, b);
+}
+
+template <typename A, typename B> requires detail::BinaryOperands<A, B>
+auto operator*(const A& a, const B& b)
+{
+	return detail::makeBinary<ops::Mul>(a, b);
+}
+
+template <typename A, typename B> requires detail::BinaryOperands<A, B>
+auto operator/(const A& a, const B& b)
+{
+	return detail::makeBinary<ops::Div>(a, b);
+}
+
+template <typename A, typename B> requires detail::BinaryOperands<A, B>
+auto pow(const A& base, const B& exponent)
+{
+	return detail::makeBinary<ops::Pow>(base, exponent);
+}
+
+template <typename A, typename B> requires detail::BinaryOperands<A, B>
+auto operator<(const A& a, const B& b)
+{
+	return detail::makeBinary<ops::Comparison<std::less<>>>(a, b);
+}
+
+template <typename A, typename B> requires detail::BinaryOperands<A, B>
+auto operator<=(const A& a, const B& b)
+{
+	return detail::makeBinary<ops::Comparison<std::less_equal<>>>(a, b);
+}
+
+template <typename A, typename B> requires detail::BinaryOperands<A, B>
+auto operator>(const A& a, const B& b)
+{
+	return detail::makeBinary<ops::Comparison<std::greater<>>>(a, b);
+}
+
+template <typename A, typename B> requires detail::BinaryOperands<A, B>
+auto operator>=(const A& a, const B& b)
+{
+	return detail::makeBinary<ops::Comparison<std::greater_equal<>>>(a, b);
+}
+
+template <typename A, typename B> requires detail::BinaryOperands<A, B>
+auto operator==(const A& a, const B& b)
+{
+	return detail::makeBinary<ops::Comparison<std::equal_to<>>>(a, b);
+}
+
+template <typename A, typename B> requires detail::BinaryOperands<A, B>
+auto operator!=(const A& a, const B& b)
+{
+	return detail::makeBinary<ops::Comparison<std::not_equal_to<>>>(a, b);
+}
+
+template <Expression E>
+auto operator-(const E& e)
+{
+	return Unary<ops::Neg, E>(e);
+}
+
+template <Expression E>
+auto exp(const E& e)
+{
+	return Unary<ops::Exp, E>(e);
+}
+
+template <Expression E>
+auto log(const E& e)
+{
+	return Unary<ops::Log, E>(e);
+}
+
+template <Expression E>
+auto relu(const E& e)
+{
+	return Unary<ops::ReLU, E>(e);
+}
+
+} // namespace expr
+
+/// start a lazy element-wise expression (see num::expr)
+template <num_t T>
+expr::Leaf<T> lazy(const Tensor<T>& tensor)
+{
+	return expr::Leaf<T>(tensor);
+}
+
+} // namespace num
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef FUNCTION_H
+#define FUNCTION_H
+
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+#include "Tensor.h"
+#include "GradMode.h"
+#include "StaticGraph.h"
+#include "Profiler.h"
+
+namespace autofn {
+
+/// Records out as the result of an operation on inputs in the autograd
+/// graph if grad mode is enabled and any input requires a gradient.
+/// Otherwise the result doesn't require a gradient and keeps no
+/// references to the inputs. name shows up in the backward events
+/// of the Profiler.
+template <num::num_t T>
+void recordOperation(
+	num::Tensor<T>& out,
+	std::function<void(const num::Tensor<T>&, const std::vector<num::Tensor<T>>&)> backwardFn,
+	std::vector<num::Tensor<T>> inputs,
+	const char* name = nullptr)
+{
+	bool record = GradMode::isEnabled() && std::ranges::any_of(
+		inputs, [](const num::Tensor<T>& t) {return t.requiresGrad();});
+	if (record) {
+		out.setGradFn(std::move(backwardFn), std::move(inputs), name);
+	} else {
+		out.setRequiresGrad(false);
+	}
+}
+
+/// Runs forwardFn() and records it as the forward pass of the operation
+/// name on inputs if the Profiler is running
+template <num::num_t T, typename ForwardFn>
+num::Tensor<T> profiledForward(const char* name, const std::vector<num::Tensor<T>>& inputs, const ForwardFn& forwardFn)
+{
+	if (!Profiler::isEnabled()) [[likely]] {
+		return forwardFn();
+	}
+	ProfileRecord record(name, ProfilePhase::forward);
+	num::Tensor<T> out = forwardFn();
+	record.shapes = profileShapes(inputs, out.dims);
+	return out;
+}
+
+template <num::num_t T, typename Derived>
+class Function {
+public:
+	/// Runs Derived::forward and records the operation with
+	/// Derived::backward (see recordOperation)
+	static num::Tensor<T> apply(std::initializer_list<num::Tensor<T>> args)
+	{
+		std::vector<num::Tensor<T>> inputs(args);
+		constexpr const char* name = detail::typeName<Derived>();
+		num::Tensor<T> out = profiledForward<T>(name, inputs, [&inputs]() {
+			return tracedForward<T>(inputs, [](const std::vector<num::Tensor<T>>& in) {
+				// the forward pass itself is a single node
+				NoGradGuard noGrad;
+				return Derived::forward(in);
+			});
+		});
+		recordOperation<T>(out, Derived::backward, std::move(inputs), name);
+		return out;
+	}
+};
+
+} // namespace autofn
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+#include "Parallel.h"
+#include "BFloat16.h"
+
+namespace num {
+
+/// Blocking of the GEMM kernel computing in type T (acc_t of the elements).
+/// An MR x NR tile of C is accumulated in registers, a KC x NR sliver
+/// of packed B is meant to stay in L1 and an MC x KC block of packed A in L2.
+template <typename T>
+struct GemmBlocking {
+	static constexpr int MR = 4;
+	// 64 bytes per row of the micro tile, i.e. 8 doubles or 16 floats
+	static constexpr int NR = std::max<int>(4, 64 / sizeof(T));
+	static constexpr int KC = 256;
+	static constexpr int MC = 32 * MR;
+	static constexpr int NC = 512 * NR;
+
+	/// products with fewer multiply-adds than this skip packing
+	static constexpr long smallThreshold = 32 * 32 * 32;
+};
+
+namespace detail {
+
+/// leaves the elements of C as they are
+struct NoEpilogue {
+	template <typename T>
+	T operator()(int, int, T val) const noexcept
+	{
+		return val;
+	}
+};
+
+/// copy an mc x kc block of A into row panels of MR rows, each stored
+/// column by column and zero padded to a full panel. The panels hold
+/// the accumulator type, so narrow elements are widened once here.
+template <typename T, typename Acc>
+void packA(int mc, int kc, const T* A, int rsA, int csA, Acc* packed)
+{
+	constexpr int MR = GemmBlocking<Acc>::MR;
+	for (int ir = 0; ir < mc; ir += MR) {
+		int mr = std::min(MR, mc - ir);
+		for (int p = 0; p < kc; ++p) {
+			for (int i = 0; i < mr; ++i) {
+				packed[i] = static_cast<Acc>(A[(ir + i) * rsA + p * csA]);
+			}
+			for (int i = mr; i < MR; ++i) {
+				packed[i] = 0;
+			}
+			packed += MR;
+		}
+	}
+}
+
+/// copy a kc x nr sliver of B row by row, zero padded to NR columns
+template <typename T, typename Acc>
+void packBPanel(int kc, int nr, const T* B, int rsB, int csB, Acc* packed)
+{
+	constexpr int NR = GemmBlocking<Acc>::NR;
+	for (int p = 0; p < kc; ++p) {
+		for (int j = 0; j < nr; ++j) {
+			packed[j] = static_cast<Acc>(B[p * rsB + j * csB]);
+		}
+		for (int j = nr; j < NR; ++j) {
+			packed[j] = 0;
+		}
+		packed += NR;
+	}
+}
+
+/// C[0:mr, 0:nr] (+)= packed A panel * packed B panel, C is either the
+/// output or a buffer of partial sums in the accumulator type.
+/// The full MR x NR product is always computed on the zero padded panels
+/// so that the inner loops have constant trip counts and get vectorized.
+/// On the last block of K every element of the tile, which starts at
+/// row i0 and column j0 of C, is passed through the epilogue.
+template <typename T, typename Acc, typename Epilogue>
+void gemmMicroKernel(
+	int kc, const Acc* __restrict packedA, const Acc* __restrict packedB,
+	T* C, int rsC, int csC, int mr, int nr, bool accumulate,
+	int i0, int j0, bool lastBlock, const Epilogue& epilogue)
+{
+	constexpr int MR = GemmBlocking<Acc>::MR;
+	constexpr int NR = GemmBlocking<Acc>::NR;
+	Acc acc[MR][NR] = {};
+	for (int p = 0; p < kc; ++p) {
+		for (int i = 0; i < MR; ++i) {
+			const Acc a = packedA[i];
+			for (int j = 0; j < NR; ++j) {
+				acc[i][j] += a * packedB[j];
+			}
+		}
+		packedA += MR;
+		packedB += NR;
+	}
+
+	for (int i = 0; i < mr; ++i) {
+		for (int j = 0; j < nr; ++j) {
+			T& c = C[i * rsC + j * csC];
+			c = static_cast<T>(accumulate ? static_cast<Acc>(c) + acc[i][j] : acc[i][j]);
+			if constexpr (!std::is_same_v<Epilogue, NoEpilogue>) {
+				if (lastBlock) {
+					c = epilogue(i0 + i, j0 + j, c);
+				}
+			}
+		}
+	}
+}
+
+/// unblocked product for matrices too small to amortize packing
+template <typename T, typename Epilogue>
+void gemmSmall(
+	int M, int N, int K,
+	const T* A, int rsA, int csA,
+	const T* B, int rsB, int csB,
+	T* C, int rsC, int csC, bool accumulate, const Epilogue& epilogue)
+{
+	using Acc = acc_t<T>;
+	if constexpr (!std::is_same_v<Acc, T>) {
+		// narrow elements are summed up in a row of accumulators
+		thread_local std::vector<Acc> row;
+		row.resize(N);
+		for (int i = 0; i < M; ++i) {
+			T* cRow = C + i * rsC;
+			for (int j = 0; j < N; ++j) {
+				row[j] = accumulate ? static_cast<Acc>(cRow[j * csC]) : Acc(0);
+			}
+			for (int p = 0; p < K; ++p) {
+				const Acc a = static_cast<Acc>(A[i * rsA + p * csA]);
+				const T* bRow = B + p * rsB;
+				for (int j = 0; j < N; ++j) {
+					row[j] += a * static_cast<Acc>(bRow[j * csB]);
+				}
+			}
+			for (int j = 0; j < N; ++j) {
+				cRow[j * csC] = epilogue(i, j, static_cast<T>(row[j]));
+			}
+		}
+		return;
+	}
+	for (int i = 0; i < M; ++i) {
+		T* cRow = C + i * rsC;
+		if (!accumulate) {
+			for (int j = 0; j < N; ++j) {
+				cRow[j * csC] = 0;
+			}
+		}
+		for (int p = 0; p < K; ++p) {
+			const T a = A[i * rsA + p * csA];
+			const T* bRow = B + p * rsB;
+			for (int j = 0; j < N; ++j) {
+				cRow[j * csC] += a * bRow[j * csB];
+			}
+		}
+		if constexpr (!std::is_same_v<Epilogue, NoEpilogue>) {
+			for (int j = 0; j < N; ++j) {
+				cRow[j * csC] = epilogue(i, j, cRow[j * csC]);
+			}
+		}
+	}
+}
+
+} // namespace detail
+
+/// C = A·B, or C += A·B if accumulate is set, for an M x K matrix A
+/// and a K x N matrix B.
+/// Every matrix is given by a pointer to its first element and its row
+/// and column strides so transposed operands (A·Bᵀ, Aᵀ·B) are passed by
+/// swapping their strides without copying them.
+/// Blocks of C are computed in parallel. Products are accumulated in
+/// acc_t<T>, e.g. in float for bfloat16 matrices, and only the final
+/// sums are rounded to T.
+/// Every finished element C[i,j] is replaced by epilogue(i, j, C[i,j])
+/// while it is still in cache, e.g. to add a bias and apply an activation.
+template <typename T, typename Epilogue = detail::NoEpilogue>
+void gemm(
+	int M, int N, int K,
+	const T* A, int rsA, int csA,
+	const T* B, int rsB, int csB,
+	T* C, int rsC, int csC, bool accumulate = false,
+	const Epilogue& epilogue = {})
+{
+	using Acc = acc_t<T>;
+	using Blocking = GemmBlocking<Acc>;
+	constexpr int MR = Blocking::MR;
+	constexpr int NR = Blocking::NR;
+
+	if (M == 0 || N == 0) {
+		return;
+	}
+	if (static_cast<long>(M) * N * K <= Blocking::smallThreshold) {
+		detail::gemmSmall(M, N, K, A, rsA, csA, B, rsB, csB, C, rsC, csC, accumulate, epilogue);
+		return;
+	}
+
+	std::vector<Acc> packedB(static_cast<size_t>(Blocking::KC) * ((std::min(N, Blocking::NC) + NR - 1) / NR * NR));
+	int numMBlocks = (M + Blocking::MC - 1) / Blocking::MC;
+
+	// narrow elements of C would be rounded after every block of K, so
+	// their sums are carried in a buffer of Acc and rounded once at the end
+	constexpr bool narrow = !std::is_same_v<Acc, T>;
+	const bool carry = narrow && K > Blocking::KC;
+	std::vector<Acc> partial(carry ? static_cast<size_t>(M) * std::min(N, Blocking::NC) : 0);
+
+	for (int jc = 0; jc < N; jc += Blocking::NC) {
+		int nc = std::min(Blocking::NC, N - jc);
+		int numBPanels = (nc + NR - 1) / NR;
+
+		// split the columns too if there are fewer row blocks than threads
+		int numColTiles = std::clamp((numThreads() + numMBlocks - 1) / numMBlocks, 1, numBPanels);
+		int panelsPerTile = (numBPanels + numColTiles - 1) / numColTiles;
+		numColTiles = (numBPanels + panelsPerTile - 1) / panelsPerTile;
+
+		if (carry && accumulate) {
+			parallelFor(0, M, 64, [&](std::ptrdiff_t begin, std::ptrdiff_t end) {
+				for (std::ptrdiff_t i = begin; i < end; ++i) {
+					for (int j = 0; j < nc; ++j) {
+						partial[i * nc + j] = static_cast<Acc>(C[i * rsC + (jc + j) * csC]);
+					}
+				}
+			});
+		}
+
+		for (int pc = 0; pc < K; pc += Blocking::KC) {
+			int kc = std::min(Blocking::KC, K - pc);
+			bool accumulateBlock = accumulate || pc > 0;
+			bool lastBlock = pc + kc == K;
+
+			parallelFor(0, numBPanels, 8, [&](std::ptrdiff_t begin, std::ptrdiff_t end) {
+				for (std::ptrdiff_t jp = begin; jp < end; ++jp) {
+					int jr = jp * NR;
+					detail::packBPanel(
+						kc, std::min(NR, nc - jr),
+						B + pc * rsB + (jc + jr) * csB, rsB, csB,
+						packedB.data() + jp * NR * kc);
+				}
+			});
+
+			parallelFor(0, numMBlocks * numColTiles, 1, [&](std::ptrdiff_t begin, std::ptrdiff_t end) {
+				thread_local std::vector<Acc> packedA;
+				packedA.resize(static_cast<size_t>(Blocking::MC) * Blocking::KC);
+				int packedBlock = -1;
+				for (std::ptrdiff_t tile = begin; tile < end; ++tile) {
+					int ib = tile / numColTiles;
+					int colTile = tile % numColTiles;
+					int ic = ib * Blocking::MC;
+					int mc = std::min(Blocking::MC, M - ic);
+					// consecutive tiles share their block of A
+					if (ib != packedBlock) {
+						detail::packA(mc, kc, A + ic * rsA + pc * csA, rsA, csA, packedA.data());
+						packedBlock = ib;
+					}
+
+					int lastPanel = std::min((colTile + 1) * panelsPerTile, numBPanels);
+					for (int jp = colTile * panelsPerTile; jp < lastPanel; ++jp) {
+						int jr = jp * NR;
+						for (int ir = 0; ir < mc; ir += MR) {
+							if (carry) {
+								detail::gemmMicroKernel(
+									kc, packedA.data() + ir * kc, packedB.data() + jp * NR * kc,
+									partial.data() + (ic + ir) * nc + jr, nc, 1,
+									std::min(MR, mc - ir), std::min(NR, nc - jr), accumulateBlock,
+									ic + ir, jc + jr, lastBlock, detail::NoEpilogue{});
+								continue;
+							}
+							detail::gemmMicroKernel(
+								kc, packedA.data() + ir * kc, packedB.data() + jp * NR * kc,
+								C + (ic + ir) * rsC + (jc + jr) * csC, rsC, csC,
+								std::min(MR, mc - ir), std::min(NR, nc - jr), accumulateBlock,
+								ic + ir, jc + jr, lastBlock, epilogue);
+						}
+					}
+				}
+			});
+		}
+
+		if (carry) {
+			parallelFor(0, M, 64, [&](std::ptrdiff_t begin, std::ptrdiff_t end) {
+				for (std::ptrdiff_t i = begin; i < end; ++i) {
+					for (int j = 0; j < nc; ++j) {
+						C[i * rsC + (jc + j) * csC] = epilogue(i, jc + j, static_cast<T>(partial[i * nc + j]));
+					}
+				}
+			});
+		}
+	}
+}
+
+} // namespace num
+
+#endif
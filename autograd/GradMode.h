@@ -0,0 +1,54 @@
+#ifndef GRAD_MODE_H
+#define GRAD_MODE_H
+
+namespace autofn {
+
+/// Per thread switch for recording the autograd graph
+class GradMode {
+public:
+	static bool isEnabled() noexcept
+	{
+		return enabled;
+	}
+
+	static void setEnabled(bool enable) noexcept
+	{
+		enabled = enable;
+	}
+private:
+	static inline thread_local bool enabled = true;
+};
+
+/// Sets the grad mode of the current thread for its lifetime
+/// and restores the previous one afterwards
+class GradModeGuard {
+public:
+	explicit GradModeGuard(bool enable)
+	  : prevEnabled (GradMode::isEnabled())
+	{
+		GradMode::setEnabled(enable);
+	}
+
+	~GradModeGuard()
+	{
+		GradMode::setEnabled(prevEnabled);
+	}
+
+	GradModeGuard(const GradModeGuard&) = delete;
+	GradModeGuard& operator=(const GradModeGuard&) = delete;
+private:
+	bool prevEnabled;
+};
+
+/// Disables graph recording in the current scope,
+/// e.g. for validation passes, inference or optimizer updates
+class NoGradGuard : public GradModeGuard {
+public:
+	NoGradGuard()
+	  : GradModeGuard(false)
+	{}
+};
+
+} // namespace autofn
+
+#endif
@@ -7,10 +7,15 @@
 #include <optional>
 #include <climits>
 #include <memory>
+#include <algorithm>
 
 #include "NumErrors.h"
 
 namespace num {
+
+/// array of ints with value semantics used for shapes, strides and indices.
+/// Up to inlineCapacity entries are stored inline so typical
+/// ranks never allocate.
 class IntArrRef {
 public:
 	using iterator = int*;
@@ -19,91 +24,117 @@ public:
 	using value_type = int;
 	using reverse_iterator = std::reverse_iterator<iterator>;
 
+	static constexpr size_type inlineCapacity = 8;
+
+	constexpr IntArrRef()
+	  : sz {0}
+	{}
+
 	template <template<typename, typename> typename Container, typename Allocator>
-	IntArrRef(Container<int, Allocator> c)
-	  : arr {std::make_shared<int[]>(c.size())}, sz {c.size()}
+	constexpr IntArrRef(const Container<int, Allocator>& c)
+	  : sz {c.size()}
 	{
-		int idx = 0;
-		for (int el : c) {
-			arr[idx++] = el;
-		}
+		allocate();
+		std::copy(c.begin(), c.end(), begin());
 	}
 
-	IntArrRef(std::initializer_list<int> c)
-	  : arr {std::make_shared<int[]>(c.size())}, sz {c.size()}
+	constexpr IntArrRef(std::initializer_list<int> c)
+	  : sz {c.size()}
 	{
-		int idx = 0;
-		for (int el : c) {
-			arr[idx++] = el;
-		}
+		allocate();
+		std::copy(c.begin(), c.end(), begin());
 	}
 
-	IntArrRef(size_type size, int fill = 0)
-	  : arr {std::make_shared<int[]>(size)}, sz {size}
+	constexpr IntArrRef(size_type size, int fill = 0)
+	  : sz {size}
 	{
-		for (int i = 0; i < size; i++) {
-			arr[i] = fill;
-		}
+		allocate();
+		std::fill(begin(), end(), fill);
 	}
 
 
-	IntArrRef(int *els, size_type size)
-	  : arr {new int[size]}, sz {size}
+	constexpr IntArrRef(const int *els, size_type size)
+	  : sz {size}
 	{
-		for (int i = 0; i < size; i++) {
-			arr[i] = els[i];
-		}
+		allocate();
+		std::copy(els, els + size, begin());
 	}
 
+	/// kept for compatibility, copies already are deep
+	constexpr IntArrRef clone() const noexcept
+	{
+		return *this;
+	}
 
-	IntArrRef clone() const noexcept
+	constexpr IntArrRef(const IntArrRef& other)
+	  : sz {other.sz}
 	{
-		return IntArrRef(arr.get(), sz);
+		allocate();
+		std::copy(other.begin(), other.end(), begin());
 	}
 
-	IntArrRef(const IntArrRef& other) = default;
+	constexpr IntArrRef& operator=(const IntArrRef& other)
+	{
+		if (this != &other) {
+			if (sz != other.sz) {
+				release();
+				sz = other.sz;
+				allocate();
+			}
+			std::copy(other.begin(), other.end(), begin());
+		}
+		return *this;
+	}
 
-	IntArrRef& operator=(const IntArrRef& other) = default;
-	// {
-	// 	if (sz != other.sz) {
-	// 		delete[] arr;
-	// 		sz = other.sz;
-	// 		arr = new int[sz];
-	// 	}
-	// 	for (int i = 0; i < sz; i++) {
-	// 		arr[i] = other.arr[i];
-	// 	}
-	// 	return *this;
-	// }
+	constexpr IntArrRef(IntArrRef&& other) noexcept
+	  : sz {other.sz}
+	{
+		if (isInline()) {
+			std::copy(other.inlineArr, other.inlineArr + sz, inlineArr);
+		} else {
+			heapArr = other.heapArr;
+			other.heapArr = nullptr;
+			other.sz = 0;
+		}
+	}
 
-	IntArrRef(IntArrRef&& other) = default;
-	//   : arr {other.arr}, sz {other.sz}
-	// {
-	// 	other.arr = nullptr;
-	// }
+	constexpr IntArrRef& operator=(IntArrRef&& other) noexcept
+	{
+		if (this != &other) {
+			release();
+			sz = other.sz;
+			if (isInline()) {
+				std::copy(other.inlineArr, other.inlineArr + sz, inlineArr);
+			} else {
+				heapArr = other.heapArr;
+				other.heapArr = nullptr;
+				other.sz = 0;
+			}
+		}
+		return *this;
+	}
 
-	~IntArrRef() = default;
+	constexpr ~IntArrRef()
+	{
+		release();
+	}
 
 	constexpr int& operator[](int idx)
 	{
-		return arr[idx];
+		return data()[idx];
 	}
 
-	bool operator==(const IntArrRef& other) const noexcept
+	constexpr int operator[](int idx) const
 	{
-		if (other.sz != sz) {
-			return false;
-		} else {
-			for (int i = 0; i < sz; i++) {
-				if (arr[i] != other.arr[i]) {
-					return false;
-				}
-			}
-			return true;
-		}
+		return data()[idx];
 	}
 
-	friend IntArrRef binaryExpr(const IntArrRef& a, const IntArrRef& b, auto fn)
+	constexpr bool operator==(const IntArrRef& other) const noexcept
+	{
+		return std::equal(begin(), end(), other.begin(), other.end());
+	}
+
+	friend constexpr IntArrRef binaryExpr(const IntArrRef& a, const IntArrRef& b, auto fn)
 	{
 		if (a.sz != b.sz) {
 			throw ShapeMismatchError("can't apply binary expression to unequally sized IntArrRefs");
@@ -111,77 +142,76 @@ public:
 
 		IntArrRef out(a.sz);
 		for (int i = 0; i < a.sz; ++i) {
-			out[i] = fn(a.at(i), b.at(i));
+			out[i] = fn(a[i], b[i]);
 		}
 		return out;
 	}
 
-	IntArrRef operator+(const IntArrRef& other) const
+	constexpr IntArrRef operator+(const IntArrRef& other) const
 	{
 		return binaryExpr(*this, other, [](int a, int b) {return a + b;});
 	}
 
-	IntArrRef operator-(const IntArrRef& other) const
+	constexpr IntArrRef operator-(const IntArrRef& other) const
 	{
 		return binaryExpr(*this, other, [](int a, int b) {return a - b;});
 	}
 
-	IntArrRef operator/(const IntArrRef& other) const
+	constexpr IntArrRef operator/(const IntArrRef& other) const
 	{
 		return binaryExpr(*this, other, [](int a, int b) {return a / b;});
 	}
 
-	IntArrRef pad(size_type noDims) const noexcept
+	constexpr IntArrRef pad(size_type noDims) const noexcept
 	{
 		IntArrRef out(noDims, 1);
 		for (int i = sz - 1, j = noDims - 1;
 			i >= 0 && j >= 0; --i, --j) {
-			out[j] = arr[i];
+			out[j] = (*this)[i];
 		}
 		return out;
 	}
 
-	bool lessThan(const IntArrRef& other, std::optional<IntArrRef> limitOpt) const
+	constexpr bool lessThan(const IntArrRef& other, const std::optional<IntArrRef>& limitOpt) const
 	{
 		if (other.sz != sz) {
 			throw ShapeMismatchError("can't compare IntArrRefs of unequal size");
 		}
 
-		IntArrRef limit = limitOpt.value_or(IntArrRef(sz, INT_MAX));
 		// as soon as any entry on the LHS is bigger
 		// than the corresponding on the RHS return false
-		for (int j = 0; j < sz; j++) {
-			if (arr[j] >= limit[j]) {
-				return false;
+		if (limitOpt) {
+			for (int j = 0; j < sz; j++) {
+				if ((*this)[j] >= (*limitOpt)[j]) {
+					return false;
+				}
 			}
 		}
 		int i = 0;
 		for (; i < sz - 1; ++i) {
-			if (arr[i] < other.arr[i]) {
+			if ((*this)[i] < other[i]) {
 				return true;
-			} else if (arr[i] > other.arr[i]) {
+			} else if ((*this)[i] > other[i]) {
 				return false;
 			}
 		}
-		return arr[i] < other.arr[i];
+		return (*this)[i] < other[i];
 	}
 
-	int incr(
-		std::optional<IntArrRef> startOpt,
-		std::optional<IntArrRef> limitOpt,
-		std::optional<IntArrRef> stepOpt)
+	constexpr int incr(
+		const std::optional<IntArrRef>& startOpt,
+		const std::optional<IntArrRef>& limitOpt,
+		const std::optional<IntArrRef>& stepOpt)
 	{
-		IntArrRef start = startOpt.value_or(IntArrRef(sz, 0));
-		IntArrRef limit = limitOpt.value_or(IntArrRef(sz, INT_MAX));
-		IntArrRef step = stepOpt.value_or(IntArrRef(sz, 1));
-		if (limit.sz != sz) {
+		if (limitOpt && limitOpt->sz != sz) {
 			throw ShapeMismatchError("limit needs to have same number of dimensions");
 		}
+		int* vals = data();
 		int i = sz - 1;
 		for (; i >= 0; --i) {
-			arr[i] += step[i];
-			if (arr[i] >= limit.arr[i]) {
-				arr[i] = start.arr[i];
+			vals[i] += stepOpt ? (*stepOpt)[i] : 1;
+			if (vals[i] >= (limitOpt ? (*limitOpt)[i] : INT_MAX)) {
+				vals[i] = startOpt ? (*startOpt)[i] : 0;
 			} else {
 				break;
 			}
@@ -190,32 +220,52 @@ public:
 		return (sz - 2) - i;
 	}
 
-	int at(int idx) const
+	constexpr int at(int idx) const
 	{
-		return arr[idx];
+		return data()[idx];
 	}
-	
-	iterator begin() const
+
+	constexpr int* data() noexcept
 	{
-		return arr.get();
+		return isInline() ? inlineArr : heapArr;
 	}
 
-	iterator end() const
+	constexpr const int* data() const noexcept
 	{
-		return arr.get() + sz;
+		return isInline() ? inlineArr : heapArr;
 	}
 
-	const_iterator cbegin() const
+	constexpr iterator begin() noexcept
 	{
-		return arr.get();
+		return data();
 	}
 
-	const_iterator cend() const
+	constexpr iterator end() noexcept
 	{
-		return arr.get() + sz;
+		return data() + sz;
 	}
 
-	int size() const
+	constexpr const_iterator begin() const noexcept
+	{
+		return data();
+	}
+
+	constexpr const_iterator end() const noexcept
+	{
+		return data() + sz;
+	}
+
+	constexpr const_iterator cbegin() const noexcept
+	{
+		return data();
+	}
+
+	constexpr const_iterator cend() const noexcept
+	{
+		return data() + sz;
+	}
+
+	constexpr int size() const noexcept
 	{
 		return sz;
 	}
@@ -224,15 +274,35 @@ public:
 	{
 		std::string out ("(");
 		for (int i = 0; i < sz; i++) {
-			out += std::to_string(arr[i]);
+			out += std::to_string((*this)[i]);
 			out += ",";
 		}
 		out += ")";
 		return out;
 	}
 private:
-	std::shared_ptr<int[]> arr;
+	int inlineArr[inlineCapacity] {};
+	// only used for more than inlineCapacity entries
+	int* heapArr = nullptr;
 	size_type sz;
+
+	constexpr bool isInline() const noexcept
+	{
+		return sz <= inlineCapacity;
+	}
+
+	constexpr void allocate()
+	{
+		if (!isInline()) {
+			heapArr = new int[sz];
+		}
+	}
+
+	constexpr void release() noexcept
+	{
+		delete[] heapArr;
+		heapArr = nullptr;
+	}
 };
 
 } // namespace num
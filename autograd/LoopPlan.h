@@ -0,0 +1,146 @@
+#ifndef LOOP_PLAN_H
+#define LOOP_PLAN_H
+
+#include <array>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+#include "IntArrRef.h"
+#include "Parallel.h"
+
+namespace num {
+
+/// Iteration space of an element-wise loop over N operands that all
+/// have shape dims (after broadcasting) but individual strides.
+/// Dimensions that all operands can walk with one stride are merged
+/// so that the innermost loop is as long as possible.
+template <size_t N>
+class LoopPlan {
+public:
+	IntArrRef dims;
+	std::array<IntArrRef, N> strides;
+
+	LoopPlan(const IntArrRef& shape, const std::array<IntArrRef, N>& operandStrides)
+	  : dims (0)
+	{
+		// collected from the innermost dimension outwards
+		std::vector<int> mergedDims;
+		std::array<std::vector<int>, N> mergedStrides;
+		for (int i = shape.size() - 1; i >= 0; --i) {
+			if (shape[i] == 1) {
+				continue;
+			}
+			bool mergeable = !mergedDims.empty();
+			for (size_t k = 0; k < N && mergeable; ++k) {
+				mergeable = operandStrides[k][i] == mergedStrides[k].back() * mergedDims.back();
+			}
+			if (mergeable) {
+				mergedDims.back() *= shape[i];
+			} else {
+				mergedDims.push_back(shape[i]);
+				for (size_t k = 0; k < N; ++k) {
+					mergedStrides[k].push_back(operandStrides[k][i]);
+				}
+			}
+		}
+		if (mergedDims.empty()) {
+			mergedDims.push_back(1);
+			for (size_t k = 0; k < N; ++k) {
+				mergedStrides[k].push_back(0);
+			}
+		}
+
+		dims = IntArrRef(std::vector<int>(mergedDims.rbegin(), mergedDims.rend()));
+		for (size_t k = 0; k < N; ++k) {
+			strides[k] = IntArrRef(std::vector<int>(mergedStrides[k].rbegin(), mergedStrides[k].rend()));
+		}
+	}
+
+	/// total number of elements
+	std::ptrdiff_t size() const noexcept
+	{
+		std::ptrdiff_t out = 1;
+		for (int dim : dims) {
+			out *= dim;
+		}
+		return out;
+	}
+
+	/// calls fn(offsets, n, innerStrides) for every run of the innermost
+	/// dimension where offsets holds the position of the run's first
+	/// element for every operand
+	template <typename Fn>
+	void forEachRow(Fn fn) const
+	{
+		forRange(0, size(), fn);
+	}
+
+	/// forEachRow split into chunks of at least grainSize elements
+	/// that are processed in parallel
+	template <typename Fn>
+	void parallelForEachRow(std::ptrdiff_t grainSize, const Fn& fn) const
+	{
+		parallelFor(0, size(), grainSize, [this, &fn](std::ptrdiff_t begin, std::ptrdiff_t end) {
+			forRange(begin, end, fn);
+		});
+	}
+
+	/// like forEachRow but only for the elements [begin, end) in row-major
+	/// order, so the first and last runs may be partial rows
+	template <typename Fn>
+	void forRange(std::ptrdiff_t begin, std::ptrdiff_t end, Fn&& fn) const
+	{
+		int lastDim = dims.size() - 1;
+		int n = dims[lastDim];
+		if (begin >= end || n == 0) {
+			return;
+		}
+		std::array<int, N> innerStrides;
+		for (size_t k = 0; k < N; ++k) {
+			innerStrides[k] = strides[k][lastDim];
+		}
+
+		// position of the first element
+		std::ptrdiff_t row = begin / n;
+		int col = begin % n;
+		std::array<std::ptrdiff_t, N> offsets {};
+		IntArrRef idx(std::max(lastDim, 0), 0);
+		for (int d = lastDim - 1; d >= 0; --d) {
+			idx[d] = row % dims[d];
+			row /= dims[d];
+			for (size_t k = 0; k < N; ++k) {
+				offsets[k] += static_cast<std::ptrdiff_t>(idx[d]) * strides[k][d];
+			}
+		}
+
+		while (begin < end) {
+			int count = std::min<std::ptrdiff_t>(n - col, end - begin);
+			std::array<std::ptrdiff_t, N> runOffsets = offsets;
+			for (size_t k = 0; k < N; ++k) {
+				runOffsets[k] += static_cast<std::ptrdiff_t>(col) * innerStrides[k];
+			}
+			fn(runOffsets, count, innerStrides);
+			begin += count;
+			col = 0;
+
+			for (int d = lastDim - 1; d >= 0; --d) {
+				++idx[d];
+				for (size_t k = 0; k < N; ++k) {
+					offsets[k] += strides[k][d];
+				}
+				if (idx[d] < dims[d]) {
+					break;
+				}
+				for (size_t k = 0; k < N; ++k) {
+					offsets[k] -= static_cast<std::ptrdiff_t>(strides[k][d]) * dims[d];
+				}
+				idx[d] = 0;
+			}
+		}
+	}
+};
+
+} // namespace num
+
+#endif
@@ -20,14 +20,18 @@ public:
 			throw std::invalid_argument("MSELoss needs exactly 2 operands");
 		}
 
-		return (args.at(0) - args.at(1)).pow_(2);
+		return num::expr::pow(num::lazy(args.at(0)) - args.at(1), T(2));
 	}
 
 	static void backward(const num::Tensor<T>& outGradient, std::vector<num::Tensor<T>> oldInputs)
 	{
-		num::Tensor<T> gradient = outGradient * num::Tensor<T>(2) * (oldInputs[0] - oldInputs[1]);
-		oldInputs[0].setBroadcastGradient(gradient);
-		oldInputs[1].setBroadcastGradient(num::Tensor<T>(-1) * gradient);
+		auto gradient = num::lazy(outGradient) * T(2) * (num::lazy(oldInputs[0]) - oldInputs[1]);
+		if (oldInputs[0].requiresGrad()) {
+			oldInputs[0].setBroadcastGradient(gradient);
+		}
+		if (oldInputs[1].requiresGrad()) {
+			oldInputs[1].setBroadcastGradient(T(-1) * gradient);
+		}
 	}
 };
 
@@ -2,7 +2,14 @@
 #define MODULE_H
 
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
 #include "Tensor.h"
+#include "Storage.h"
+#include "Checkpoint.h"
+#include "AutogradFunction.h"
 
 namespace nn {
 
@@ -16,10 +23,14 @@ public:
 		return static_cast<Derived*>(this)->forward(x);
 	}
 
+	/// parameters always require a gradient, the returned copy shares
+	/// its contents and gradient with the registered one
 	num::Tensor<T> registerParameter(const num::Tensor<T>& parameter)
 	{
-		parameters.push_back(parameter);
-		return parameter;
+		num::Tensor<T> out(parameter);
+		out.setRequiresGrad();
+		parameters.push_back(out);
+		return out;
 	}
 	template <typename modelT>
 	modelT registerModule(const modelT& module)
@@ -29,8 +40,76 @@ public:
 		}
 		return module;
 	}
+
+	/// Pack all registered parameters into one contiguous buffer and
+	/// their gradients into another one with the same layout.
+	/// Every parameter starts at a multiple of num::bufferAlignment and
+	/// all copies of it (e.g. the members of submodules) become views into
+	/// the arenas, so zeroing the gradients is a single fill and an optimizer
+	/// given flatParameter() updates the whole model in one pass.
+	/// Call it on the outermost module after registering all parameters.
+	void flattenParameters()
+	{
+		constexpr size_t alignElements = std::max<size_t>(num::bufferAlignment / sizeof(T), 1);
+		std::vector<size_t> offsets;
+		size_t totalSize = 0;
+		for (const num::Tensor<T>& p : parameters) {
+			if (!p.isContiguous() || p.size() != p.storageSize()) {
+				throw std::invalid_argument("only parameters owning their storage can be flattened");
+			}
+			offsets.push_back(totalSize);
+			totalSize += (p.size() + alignElements - 1) / alignElements * alignElements;
+		}
+
+		paramArena = num::makeAlignedBuffer<T>(totalSize);
+		gradArena = num::makeAlignedBuffer<T>(totalSize);
+		arenaSize = totalSize;
+		for (size_t i = 0; i < parameters.size(); ++i) {
+			// a parameter registered twice is already in the arena
+			T* data = parameters[i].data();
+			if (data >= paramArena.get() && data < paramArena.get() + arenaSize) {
+				continue;
+			}
+			parameters[i].relocate(std::shared_ptr<T[]>(paramArena, paramArena.get() + offsets[i]));
+			parameters[i].relocateGradient(std::shared_ptr<T[]>(gradArena, gradArena.get() + offsets[i]));
+		}
+	}
+
+	bool isFlat() const noexcept
+	{
+		return paramArena != nullptr;
+	}
+
+	/// 1d Tensor viewing the whole parameter arena whose gradient is the
+	/// gradient arena, only available after flattenParameters()
+	num::Tensor<T> flatParameter() const
+	{
+		if (!isFlat()) {
+			throw std::logic_error("parameters need to be flattened first");
+		}
+		num::Tensor<T> out = num::Tensor<T>::fromBuffer({static_cast<int>(arenaSize)}, paramArena);
+		out.setRequiresGrad();
+		out.relocateGradient(gradArena);
+		return out;
+	}
+
+	void zeroGradient()
+	{
+		if (isFlat()) {
+			std::fill_n(gradArena.get(), arenaSize, T(0));
+			return;
+		}
+		for (num::Tensor<T>& p : parameters) {
+			p.zeroGradient();
+		}
+	}
+private:
+	std::shared_ptr<T[]> paramArena;
+	std::shared_ptr<T[]> gradArena;
+	size_t arenaSize = 0;
 };
 
+/// fully connected layer, see autofn::linear
 template <num::num_t T>
 class Linear : public Module<T, Linear<T>> {
 public:
@@ -38,23 +117,54 @@ public:
 	num::Tensor<T> b;
 
 	// weights multiplied by 0.1 to keep them very small
-	Linear(int inFeatures, int outFeatures, bool withBias = true)
+	Linear(int inFeatures, int outFeatures, bool withBias = true,
+		autofn::Activation activation = autofn::Activation::none)
 	: w (this->registerParameter(num::Tensor<T>(0.1) * num::randn<T>({outFeatures, inFeatures}))),
 	  b (num::zeros<T>({outFeatures})),
-	  withBias (withBias)
+	  withBias (withBias),
+	  activation (activation)
 	{
 		if (withBias) {
-			this->registerParameter(b);
+			b = this->registerParameter(b);
 		}
 	}
 
 	num::Tensor<T> forward(const num::Tensor<T>& x) const
 	{
-        std::cout << "x: " << x.toString() << "; w: " << w.toString() << std::endl;
-		return autofn::mm<T>(x, autofn::transpose<T>(w)) + b;
+		if (withBias) {
+			return autofn::linear<T>(x, w, b, activation);
+		}
+		return autofn::linear<T>(x, w, activation);
 	}
 private:
 	bool withBias;
+	autofn::Activation activation;
+};
+
+/// Wraps a module so that its forward pass is checkpointed
+/// (see autofn::checkpoint): only its input is kept for the backward
+/// pass and the intermediate results are recomputed there.
+/// Wrapping every k-th layer of a deep stack of n layers with k ~ sqrt(n)
+/// keeps O(sqrt(n)) activations alive at the cost of one extra forward pass.
+template <num::num_t T, typename ModuleT>
+class Checkpoint : public Module<T, Checkpoint<T, ModuleT>> {
+public:
+	Checkpoint(const ModuleT& module)
+	  : module (std::make_shared<const ModuleT>(this->registerModule(module)))
+	{}
+
+	num::Tensor<T> forward(const num::Tensor<T>& x) const
+	{
+		// the graph holds on to the module so it may outlive this wrapper
+		std::shared_ptr<const ModuleT> segment = module;
+		return autofn::checkpoint<T>(
+			[segment](const std::vector<num::Tensor<T>>& inputs) {
+				return segment->forward(inputs[0]);
+			},
+			{x});
+	}
+private:
+	std::shared_ptr<const ModuleT> module;
 };
 
 } // namespace nn
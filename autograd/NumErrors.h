@@ -15,6 +15,11 @@ public:
 	ShapeMismatchError(const std::string& msg)
 		: std::runtime_error("ShapeMismatchError: " + msg) {}
 };
+class FileFormatError : public std::runtime_error {
+public:
+	FileFormatError(const std::string& msg)
+		: std::runtime_error("FileFormatError: " + msg) {}
+};
 } // namespace num
 
 #endif
\ No newline at end of file
@@ -2,17 +2,128 @@
 #define OPTIM_H
 
 #include <vector>
-#include <optional>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 
 #include "Tensor.h"
 #include "TensorFactory.h"
-#include "Slice.h"
+#include "Parallel.h"
 
 namespace optim {
 
+namespace detail {
+
+/// Parameter i of an update computing in M: param itself or, for narrow
+/// parameters (M wider than T), its master copy in M. The result is
+/// written to both, rounded for param.
+template <typename T, typename M>
+struct MasterAccess {
+	T* __restrict param;
+	M* __restrict master;
+
+	M load(std::ptrdiff_t i) const
+	{
+		if constexpr (std::is_same_v<T, M>) {
+			return param[i];
+		} else {
+			return master[i];
+		}
+	}
+
+	void store(std::ptrdiff_t i, M val) const
+	{
+		if constexpr (!std::is_same_v<T, M>) {
+			master[i] = val;
+		}
+		param[i] = static_cast<T>(val);
+	}
+};
+
+/// v = momentum * v - lr * (g + weightDecay * p); p += v
+/// (or p += momentum * v - lr * g with Nesterov momentum)
+template <typename T, typename M = T>
+void sgdKernel(
+	std::ptrdiff_t n, T* __restrict param, M* __restrict master, const T* __restrict grad, M* __restrict velocity,
+	M learningRate, M momentum, M weightDecay, bool nesterov)
+{
+	MasterAccess<T, M> p {param, master};
+	if (momentum == M(0)) {
+		for (std::ptrdiff_t i = 0; i < n; ++i) {
+			M val = p.load(i);
+			p.store(i, val - learningRate * (static_cast<M>(grad[i]) + weightDecay * val));
+		}
+	} else if (nesterov) {
+		for (std::ptrdiff_t i = 0; i < n; ++i) {
+			M val = p.load(i);
+			M g = static_cast<M>(grad[i]) + weightDecay * val;
+			M v = momentum * velocity[i] - learningRate * g;
+			velocity[i] = v;
+			p.store(i, val + (momentum * v - learningRate * g));
+		}
+	} else {
+		for (std::ptrdiff_t i = 0; i < n; ++i) {
+			M val = p.load(i);
+			M v = momentum * velocity[i] - learningRate * (static_cast<M>(grad[i]) + weightDecay * val);
+			velocity[i] = v;
+			p.store(i, val + v);
+		}
+	}
+}
+
+/// one Adam step for n elements with bias corrections 1 - beta^t.
+/// Weight decay is either added to the gradient (L2 penalty) or
+/// applied to the parameter directly (decoupled, AdamW).
+template <typename T, typename M = T>
+void adamKernel(
+	std::ptrdiff_t n, T* __restrict param, M* __restrict master, const T* __restrict grad,
+	M* __restrict firstMoment, M* __restrict secondMoment,
+	M learningRate, M beta1, M beta2, M epsilon,
+	M biasCorrection1, M biasCorrection2, M weightDecay, bool decoupledWeightDecay)
+{
+	MasterAccess<T, M> p {param, master};
+	const M stepSize = learningRate / biasCorrection1;
+	const M invBiasCorrection2 = M(1) / biasCorrection2;
+	const M l2 = decoupledWeightDecay ? M(0) : weightDecay;
+	const M paramScale = decoupledWeightDecay ? M(1) - learningRate * weightDecay : M(1);
+	for (std::ptrdiff_t i = 0; i < n; ++i) {
+		M val = p.load(i);
+		M g = static_cast<M>(grad[i]) + l2 * val;
+		M m = beta1 * firstMoment[i] + (M(1) - beta1) * g;
+		M v = beta2 * secondMoment[i] + (M(1) - beta2) * g * g;
+		firstMoment[i] = m;
+		secondMoment[i] = v;
+		p.store(i, paramScale * val - stepSize * m / (std::sqrt(v * invBiasCorrection2) + epsilon));
+	}
+}
+
+} // namespace detail
+
+/// Everything an optimizer accumulates over the steps, e.g. to save it
+/// together with the parameters and resume training later
+/// (see nn::saveTrainingState). Hyperparameters aren't part of it.
+template <num::num_t T>
+struct OptimizerState {
+	/// per parameter buffers like moments, in the order of the parameters
+	std::vector<num::Tensor<T>> tensors;
+	/// step counters
+	std::vector<std::int64_t> counters;
+};
+
 template <num::num_t T, typename Derived>
 class OptimBase {
 public:
+	/// type the updates are computed and the optimizer state is kept in,
+	/// float for bfloat16 parameters
+	using Master = num::acc_t<T>;
+	/// narrow parameters are updated through master copies in Master
+	/// so that small updates aren't lost to rounding
+	static constexpr bool hasMasterWeights = !std::is_same_v<Master, T>;
+
 	void zeroGradient()
 	{
 		static_cast<Derived *>(this)->zeroGradient();
@@ -22,108 +133,378 @@ public:
 	{
 		static_cast<Derived *>(this)->step();
 	}
+protected:
+	/// copy the contents of src into the equally shaped contiguous dst
+	template <num::num_t U>
+	static void loadTensors(const std::vector<num::Tensor<U>>& src, std::vector<num::Tensor<U>>& dst)
+	{
+		if (src.size() != dst.size()) {
+			throw std::invalid_argument("optimizer state has " + std::to_string(src.size())
+				+ " Tensors but the optimizer needs " + std::to_string(dst.size()));
+		}
+		for (size_t i = 0; i < src.size(); ++i) {
+			if (src[i].dims != dst[i].dims) {
+				throw num::ShapeMismatchError("can't load optimizer state of shape " + src[i].dims.toString()
+					+ " into buffer of shape " + dst[i].dims.toString());
+			}
+			num::Tensor<U> contiguous = src[i].contiguous();
+			std::copy_n(contiguous.data(), contiguous.size(), dst[i].data());
+		}
+	}
+
+	/// master copies of the parameters, none if they are Master already
+	static std::vector<num::Tensor<Master>> makeMasterWeights(const std::vector<num::Tensor<T>>& parameters)
+	{
+		std::vector<num::Tensor<Master>> out;
+		if constexpr (hasMasterWeights) {
+			for (const num::Tensor<T>& p : parameters) {
+				num::Tensor<Master> master(p.dims);
+				std::copy_n(p.data(), p.size(), master.data());
+				out.push_back(master);
+			}
+		}
+		return out;
+	}
+
+	static Master* masterData(const std::vector<num::Tensor<Master>>& masterWeights, std::size_t i)
+	{
+		return masterWeights.empty() ? nullptr : masterWeights[i].data();
+	}
+
+	/// the updates work on the raw buffers so parameters need to own
+	/// contiguous storage and require a gradient
+	static void checkParameters(const std::vector<num::Tensor<T>>& parameters)
+	{
+		for (const num::Tensor<T>& p : parameters) {
+			if (!p.isContiguous() || !p.requiresGrad()) {
+				throw std::invalid_argument("optimizer parameters need to be contiguous and require a gradient");
+			}
+		}
+	}
+
+	/// calls fn(i, begin, end) for ranges [begin, end) of the elements of
+	/// every parameter i. If there is enough work many parameters are spread
+	/// over threads and single large ones (e.g. a flat arena) are split.
+	template <typename Fn>
+	static void forEachParameter(const std::vector<num::Tensor<T>>& parameters, const Fn& fn)
+	{
+		std::size_t totalSize = 0;
+		for (const num::Tensor<T>& p : parameters) {
+			totalSize += p.size();
+		}
+		std::ptrdiff_t grainSize = (totalSize >= num::defaultGrainSize) ? 1 : parameters.size();
+		num::parallelFor(0, parameters.size(), grainSize, [&](std::ptrdiff_t begin, std::ptrdiff_t end) {
+			for (std::ptrdiff_t i = begin; i < end; ++i) {
+				// runs serially if the parameters are already spread over threads
+				num::parallelFor(0, parameters[i].size(), num::defaultGrainSize,
+					[&fn, i](std::ptrdiff_t elemBegin, std::ptrdiff_t elemEnd) {
+						fn(i, elemBegin, elemEnd);
+					});
+			}
+		});
+	}
 };
 
+/// stochastic gradient descent with optional (Nesterov) momentum
+/// and L2 weight decay
 template <num::num_t T>
 class SGD : public OptimBase<T, SGD<T>> {
 public:
+	using Master = typename OptimBase<T, SGD<T>>::Master;
+
 	SGD(const std::vector<num::Tensor<T>>& parameters,
 		 double learningRate = 0.1,
-		 double momentum = 0.0)
+		 double momentum = 0.0,
+		 bool nesterov = false,
+		 double weightDecay = 0.0)
 	: parameters (parameters),
-	  paramMomentum (parameters),
+	  masterWeights (this->makeMasterWeights(parameters)),
 	  learningRate (learningRate),
-	  momentum (momentum)
+	  momentum (momentum),
+	  weightDecay (weightDecay),
+	  nesterov (nesterov)
 	{
+		this->checkParameters(parameters);
+		for (const num::Tensor<T>& p : parameters) {
+			paramMomentum.push_back(num::zeros<Master>(p.dims));
+		}
 		zeroGradient();
 	}
 
 	void zeroGradient()
 	{
-		for (int i = 0; i < parameters.size(); ++i) {
-			parameters[i].zeroGradient();
-			paramMomentum[i] = num::zeros<T>(parameters[i].dims);
+		for (num::Tensor<T>& p : parameters) {
+			p.zeroGradient();
 		}
 	}
 
+	/// update every parameter in place in a single pass over its elements
 	void step()
 	{
-		for (int i = 0; i < parameters.size(); ++i) {
-			// std::cout << parameters[i].getGradient().toString() << std::endl;
-			num::Tensor<T> paramUpdate = momentum * paramMomentum[i] -
-					learningRate * parameters[i].getGradient();
-			paramMomentum[i] = paramUpdate;
-			parameters[i].set(parameters[i] + paramUpdate, {num::Slice{std::nullopt, std::nullopt, std::nullopt}});
+		this->forEachParameter(parameters, [this](std::ptrdiff_t i, std::ptrdiff_t begin, std::ptrdiff_t end) {
+			// parameters without a gradient weren't used
+			if (const T* grad = parameters[i].gradData()) {
+				Master* master = this->masterData(masterWeights, i);
+				detail::sgdKernel<T, Master>(
+					end - begin, parameters[i].data() + begin, master ? master + begin : nullptr,
+					grad + begin, paramMomentum[i].data() + begin,
+					learningRate, momentum, weightDecay, nesterov);
+			}
+		});
+	}
+
+	/// the momentum of every parameter followed by the master weights if
+	/// there are any, sharing their contents with the optimizer
+	OptimizerState<Master> state() const
+	{
+		OptimizerState<Master> out {paramMomentum, {}};
+		out.tensors.insert(out.tensors.end(), masterWeights.begin(), masterWeights.end());
+		return out;
+	}
+
+	/// continue with the state returned by state()
+	/// of an optimizer for parameters of the same shapes
+	void loadState(const OptimizerState<Master>& state)
+	{
+		std::size_t n = parameters.size();
+		if (state.tensors.size() != (this->hasMasterWeights ? 2 : 1) * n) {
+			throw std::invalid_argument("optimizer state doesn't belong to SGD with "
+				+ std::to_string(n) + " parameters");
 		}
+		this->loadTensors(std::vector<num::Tensor<Master>>(state.tensors.begin(), state.tensors.begin() + n), paramMomentum);
+		this->loadTensors(std::vector<num::Tensor<Master>>(state.tensors.begin() + n, state.tensors.end()), masterWeights);
 	}
 private:
 	std::vector<num::Tensor<T>> parameters;
-	std::vector<num::Tensor<T>> paramMomentum;
+	std::vector<num::Tensor<Master>> masterWeights;
+	std::vector<num::Tensor<Master>> paramMomentum;
 
-	num::Tensor<T> learningRate;
-	num::Tensor<T> momentum;
+	Master learningRate;
+	Master momentum;
+	Master weightDecay;
+	bool nesterov;
 };
 
 
 
+/// Adam with optional L2 weight decay
 template <num::num_t T>
 class Adam : public OptimBase<T, Adam<T>> {
 public:
+	using Master = typename OptimBase<T, Adam<T>>::Master;
+
 	Adam(const std::vector<num::Tensor<T>>& parameters,
 		 double learningRate = 0.001,
 		 double epsilon = 1e-7,
 		 double beta_1 = 0.9,
-		 double beta_2 = 0.999)
+		 double beta_2 = 0.999,
+		 double weightDecay = 0.0)
+	: Adam(parameters, learningRate, epsilon, beta_1, beta_2, weightDecay, false)
+	{}
+
+	void zeroGradient()
+	{
+		for (num::Tensor<T>& p : parameters) {
+			p.zeroGradient();
+		}
+	}
+
+	/// update every parameter and its moments in place
+	/// in a single pass over its elements
+	void step()
+	{
+		Master biasCorrection1 = 1 - std::pow(beta_1, iteration);
+		Master biasCorrection2 = 1 - std::pow(beta_2, iteration);
+		this->forEachParameter(parameters, [&, this](std::ptrdiff_t i, std::ptrdiff_t begin, std::ptrdiff_t end) {
+			// parameters without a gradient weren't used
+			if (const T* grad = parameters[i].gradData()) {
+				Master* master = this->masterData(masterWeights, i);
+				detail::adamKernel<T, Master>(
+					end - begin, parameters[i].data() + begin, master ? master + begin : nullptr, grad + begin,
+					paramMomentum[i].data() + begin, paramCache[i].data() + begin,
+					learningRate, beta_1, beta_2, epsilon,
+					biasCorrection1, biasCorrection2, weightDecay, decoupledWeightDecay);
+			}
+		});
+		iteration += 1;
+	}
+
+	/// first moments, second moments and master weights (if there are any)
+	/// of all parameters, sharing their contents with the optimizer,
+	/// and the number of the next step
+	OptimizerState<Master> state() const
+	{
+		OptimizerState<Master> out {paramMomentum, {iteration}};
+		out.tensors.insert(out.tensors.end(), paramCache.begin(), paramCache.end());
+		out.tensors.insert(out.tensors.end(), masterWeights.begin(), masterWeights.end());
+		return out;
+	}
+
+	/// continue with the state returned by state()
+	/// of an optimizer for parameters of the same shapes
+	void loadState(const OptimizerState<Master>& state)
+	{
+		std::size_t n = parameters.size();
+		if (state.tensors.size() != (this->hasMasterWeights ? 3 : 2) * n || state.counters.size() != 1) {
+			throw std::invalid_argument("optimizer state doesn't belong to Adam with "
+				+ std::to_string(n) + " parameters");
+		}
+		auto part = [&state, n](std::size_t k) {
+			return std::vector<num::Tensor<Master>>(state.tensors.begin() + k * n, state.tensors.begin() + (k + 1) * n);
+		};
+		this->loadTensors(part(0), paramMomentum);
+		this->loadTensors(part(1), paramCache);
+		if constexpr (OptimBase<T, Adam<T>>::hasMasterWeights) {
+			this->loadTensors(part(2), masterWeights);
+		}
+		iteration = state.counters[0];
+	}
+protected:
+	Adam(const std::vector<num::Tensor<T>>& parameters,
+		 double learningRate, double epsilon, double beta_1, double beta_2,
+		 double weightDecay, bool decoupledWeightDecay)
 	: parameters (parameters),
-	  paramMomentum (parameters),
-	  paramCache (parameters),
+	  masterWeights (this->makeMasterWeights(parameters)),
 	  learningRate (learningRate),
 	  epsilon (epsilon),
 	  beta_1 (beta_1),
 	  beta_2 (beta_2),
+	  weightDecay (weightDecay),
+	  decoupledWeightDecay (decoupledWeightDecay),
 	  iteration (1)
 	{
+		this->checkParameters(parameters);
+		for (const num::Tensor<T>& p : parameters) {
+			paramMomentum.push_back(num::zeros<Master>(p.dims));
+			paramCache.push_back(num::zeros<Master>(p.dims));
+		}
 		zeroGradient();
 	}
+private:
+	std::vector<num::Tensor<T>> parameters;
+	std::vector<num::Tensor<Master>> masterWeights;
+	std::vector<num::Tensor<Master>> paramMomentum;
+	std::vector<num::Tensor<Master>> paramCache;
 
-	void zeroGradient()
+	Master learningRate;
+	Master epsilon;
+	Master beta_1;
+	Master beta_2;
+	Master weightDecay;
+	bool decoupledWeightDecay;
+	std::int64_t iteration;
+};
+
+/// Adam with weight decay applied to the parameters directly
+/// instead of through the gradient
+template <num::num_t T>
+class AdamW : public Adam<T> {
+public:
+	AdamW(const std::vector<num::Tensor<T>>& parameters,
+		 double learningRate = 0.001,
+		 double epsilon = 1e-7,
+		 double beta_1 = 0.9,
+		 double beta_2 = 0.999,
+		 double weightDecay = 0.01)
+	: Adam<T>(parameters, learningRate, epsilon, beta_1, beta_2, weightDecay, true)
+	{}
+};
+
+
+
+struct LossScalerOptions {
+	double initialScale = 65536;
+	/// the scale is multiplied by growthFactor after growthInterval
+	/// steps in a row with finite gradients
+	double growthFactor = 2;
+	int growthInterval = 2000;
+	/// and by backoffFactor after a step with an overflow
+	double backoffFactor = 0.5;
+};
+
+/// Dynamic loss scaling for training in narrow types like bfloat16: the
+/// loss is multiplied by a large scale before backward() so that small
+/// gradients don't underflow, and the gradients are divided by it again
+/// right before the update. Steps whose gradients overflowed (inf or NaN)
+/// are skipped and make the scale smaller, long runs without overflow
+/// make it larger again.
+///
+///     optim::LossScaler<num::bfloat16> scaler({model.flatParameter()});
+///     opt.zeroGradient();
+///     scaler.scale(loss).backward();
+///     scaler.step(opt);
+template <num::num_t T>
+class LossScaler {
+public:
+	LossScaler(const std::vector<num::Tensor<T>>& parameters, const LossScalerOptions& options = {})
+	: parameters (parameters),
+	  options (options),
+	  scaleFactor (options.initialScale)
+	{}
+
+	/// loss times the current scale, call backward() on it
+	num::Tensor<T> scale(const num::Tensor<T>& loss) const
 	{
-		for (int i = 0; i < parameters.size(); ++i) {
-			parameters[i].zeroGradient();
-			paramMomentum[i] = num::zeros<T>(parameters[i].dims);
-			paramCache[i] = num::zeros<T>(parameters[i].dims);
-		}
+		return loss * num::Tensor<T>(static_cast<T>(scaleFactor));
 	}
 
-	void step()
+	/// Unscale the gradients and run optimizer.step() if they are all
+	/// finite. Returns whether the step was taken.
+	template <typename Optimizer>
+	bool step(Optimizer& optimizer)
 	{
-		for (int i = 0; i < parameters.size(); ++i) {
-			// std::cout << parameters[i].getGradient().toString() << std::endl;
-			num::Tensor<T> grad = parameters[i].getGradient();
-			paramMomentum[i] = beta_1 * paramMomentum[i] + (num::Tensor<T>(1) - beta_1) * grad;
-			num::Tensor<T> momentumCorrected = paramMomentum[i] / (num::Tensor<T>(1) - autofn::pow<T>(beta_1, iteration));
-			paramCache[i] = beta_2 * paramCache[i] + (num::Tensor<T>(1) - beta_2) * autofn::pow<T>(grad, 2);
-			num::Tensor<T> cacheCorrected = paramCache[i] / (num::Tensor<T>(1) - autofn::pow<T>(beta_2, iteration));
-			num::Tensor<T> paramUpdate = - learningRate * momentumCorrected /
-					(autofn::pow<T>(cacheCorrected, 0.5) + epsilon);
-			parameters[i].set(parameters[i] + paramUpdate, {num::Slice{std::nullopt, std::nullopt, std::nullopt}});
+		if (!unscaleGradients()) {
+			scaleFactor *= options.backoffFactor;
+			goodSteps = 0;
+			return false;
+		}
+		optimizer.step();
+		if (++goodSteps >= options.growthInterval) {
+			scaleFactor *= options.growthFactor;
+			goodSteps = 0;
 		}
-		iteration += 1.0;
+		return true;
+	}
+
+	double getScale() const noexcept
+	{
+		return scaleFactor;
 	}
 private:
 	std::vector<num::Tensor<T>> parameters;
-	std::vector<num::Tensor<T>> paramMomentum;
-	std::vector<num::Tensor<T>> paramCache;
-
-	num::Tensor<T> learningRate;
-	num::Tensor<T> epsilon;
-	num::Tensor<T> beta_1;
-	num::Tensor<T> beta_2;
-	double iteration;
-};
-
+	LossScalerOptions options;
+	double scaleFactor;
+	int goodSteps = 0;
 
+	/// divide all gradients by the scale, false if any of them isn't finite
+	bool unscaleGradients()
+	{
+		using Acc = num::acc_t<T>;
+		const Acc invScale = static_cast<Acc>(1 / scaleFactor);
+		std::atomic<bool> finite = true;
+		for (num::Tensor<T>& p : parameters) {
+			T* grad = p.gradData();
+			if (!grad) {
+				continue;
+			}
+			num::parallelFor(0, p.size(), num::defaultGrainSize, [&](std::ptrdiff_t begin, std::ptrdiff_t end) {
+				// g - g is 0 for finite g and NaN otherwise, which
+				// keeps the loop free of branches
+				Acc check = 0;
+				for (std::ptrdiff_t i = begin; i < end; ++i) {
+					Acc g = static_cast<Acc>(grad[i]) * invScale;
+					check += g - g;
+					grad[i] = static_cast<T>(g);
+				}
+				if (!(check == Acc(0))) {
+					finite.store(false, std::memory_order_relaxed);
+				}
+			});
+		}
+		return finite.load();
+	}
+};
 
 } // namespace optim
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,166 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "ThreadPool.h"
+
+namespace num {
+
+/// element-wise kernels over fewer elements than this run serially
+/// so that small Tensors don't pay for dispatching work to threads
+inline constexpr std::ptrdiff_t defaultGrainSize = 1 << 15;
+
+namespace detail {
+// 0 until the thread count is first needed
+inline std::atomic<int> configuredThreads {0};
+
+inline std::mutex poolMutex;
+inline std::unique_ptr<ThreadPool> pool;
+inline std::atomic<ThreadPool*> poolPtr {nullptr};
+
+// set while a thread executes a chunk of a parallelFor
+inline thread_local bool inParallelRegion = false;
+
+/// NUM_THREADS if set to a positive number, otherwise the number
+/// of hardware threads
+inline int defaultNumThreads()
+{
+	if (const char* env = std::getenv("NUM_THREADS")) {
+		try {
+			int fromEnv = std::stoi(env);
+			if (fromEnv > 0) {
+				return fromEnv;
+			}
+		} catch (const std::exception&) {
+			// ignore malformed values
+		}
+	}
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+} // namespace detail
+
+/// number of threads the parallel kernels split their work into,
+/// including the calling thread
+inline int numThreads()
+{
+	int threads = detail::configuredThreads.load(std::memory_order_relaxed);
+	if (threads == 0) {
+		int expected = 0;
+		detail::configuredThreads.compare_exchange_strong(expected, detail::defaultNumThreads());
+		threads = detail::configuredThreads.load(std::memory_order_relaxed);
+	}
+	return threads;
+}
+
+/// Pool running the parallel work of the library.
+/// It is started on first use with numThreads() - 1 workers
+/// as the calling thread always takes part in the work.
+inline ThreadPool& threadPool()
+{
+	if (ThreadPool* pool = detail::poolPtr.load(std::memory_order_acquire)) {
+		return *pool;
+	}
+	std::lock_guard<std::mutex> lock(detail::poolMutex);
+	if (!detail::pool) {
+		detail::pool = std::make_unique<ThreadPool>(numThreads() - 1);
+		detail::poolPtr.store(detail::pool.get(), std::memory_order_release);
+	}
+	return *detail::pool;
+}
+
+/// Set the number of threads used by the library (overrides NUM_THREADS).
+/// A running pool is replaced so this must not be called while
+/// other threads are using the library.
+inline void setNumThreads(int threads)
+{
+	if (threads < 1) {
+		throw std::invalid_argument("need at least one thread");
+	}
+	std::lock_guard<std::mutex> lock(detail::poolMutex);
+	detail::configuredThreads = threads;
+	if (detail::pool && detail::pool->size() != threads - 1) {
+		detail::poolPtr.store(nullptr, std::memory_order_release);
+		// joins the old workers
+		detail::pool.reset();
+	}
+}
+
+/// true if called from within a chunk of a parallelFor
+inline bool inParallelRegion()
+{
+	return detail::inParallelRegion;
+}
+
+/// Split [begin, end) into at most numThreads() chunks of at least
+/// grainSize elements and call fn(chunkBegin, chunkEnd) for each of them
+/// concurrently on the thread pool. The calling thread processes the first
+/// chunk itself and helps with pending work until all chunks are done.
+/// Nested calls from within a chunk run serially so that e.g. a parallel
+/// loop over a batch of GEMMs doesn't split every GEMM again.
+/// The first exception thrown by fn is rethrown after all chunks finished.
+template <typename Fn>
+void parallelFor(std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t grainSize, const Fn& fn)
+{
+	std::ptrdiff_t range = end - begin;
+	if (range <= 0) {
+		return;
+	}
+	grainSize = std::max<std::ptrdiff_t>(grainSize, 1);
+	std::ptrdiff_t numChunks = std::min<std::ptrdiff_t>(
+		numThreads(), (range + grainSize - 1) / grainSize);
+	if (numChunks <= 1 || inParallelRegion()) {
+		fn(begin, end);
+		return;
+	}
+
+	std::ptrdiff_t chunkSize = (range + numChunks - 1) / numChunks;
+	std::exception_ptr firstError;
+	std::mutex errorMutex;
+	std::atomic<std::ptrdiff_t> remaining = 0;
+	auto runChunk = [&](std::ptrdiff_t chunkBegin) {
+		bool wasInParallelRegion = detail::inParallelRegion;
+		detail::inParallelRegion = true;
+		try {
+			fn(chunkBegin, std::min(chunkBegin + chunkSize, end));
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(errorMutex);
+			if (!firstError) {
+				firstError = std::current_exception();
+			}
+		}
+		detail::inParallelRegion = wasInParallelRegion;
+	};
+
+	ThreadPool& pool = threadPool();
+	for (std::ptrdiff_t chunkBegin = begin + chunkSize; chunkBegin < end; chunkBegin += chunkSize) {
+		remaining.fetch_add(1, std::memory_order_relaxed);
+		pool.submit([&runChunk, &remaining, chunkBegin]() {
+			runChunk(chunkBegin);
+			remaining.fetch_sub(1, std::memory_order_acq_rel);
+		});
+	}
+	runChunk(begin);
+	while (remaining.load(std::memory_order_acquire) > 0) {
+		if (!pool.runPendingTask()) {
+			std::this_thread::yield();
+		}
+	}
+
+	if (firstError) {
+		std::rethrow_exception(firstError);
+	}
+}
+
+} // namespace num
+
+#endif
@@ -0,0 +1,317 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "Allocator.h"
+
+namespace autofn {
+
+enum class ProfilePhase {
+	forward,
+	backward
+};
+
+/// one forward or backward run of an operation
+struct ProfileEvent {
+	/// name of the operation, e.g. "MatMul"
+	const char* name;
+	ProfilePhase phase;
+	/// shapes of the inputs and of the result, e.g. "(2,3,) (3,4,) -> (2,4,)"
+	std::string shapes;
+	/// nanoseconds since Profiler::start()
+	std::int64_t startNs;
+	std::int64_t durationNs;
+	/// small number identifying the thread the operation ran on
+	std::uint32_t threadId;
+	/// bytes of Tensor buffers allocated while the operation ran
+	std::uint64_t bytesAllocated;
+};
+
+namespace detail {
+
+struct ProfileThreadBuffer {
+	std::mutex mutex;
+	std::vector<ProfileEvent> events;
+	std::uint32_t threadId;
+};
+
+struct ProfilerState {
+	std::mutex mutex;
+	/// buffers of all threads that ever recorded an event,
+	/// they outlive their threads so no event gets lost
+	std::vector<std::shared_ptr<ProfileThreadBuffer>> buffers;
+};
+
+/// leaked so that threads still recording during static destruction find it
+inline ProfilerState& profilerState()
+{
+	static ProfilerState* state = new ProfilerState();
+	return *state;
+}
+
+inline ProfileThreadBuffer& threadProfileBuffer()
+{
+	thread_local std::shared_ptr<ProfileThreadBuffer> buffer = []() {
+		auto out = std::make_shared<ProfileThreadBuffer>();
+		ProfilerState& state = profilerState();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		out->threadId = state.buffers.size();
+		state.buffers.push_back(out);
+		return out;
+	}();
+	return *buffer;
+}
+
+} // namespace detail
+
+/// Profiling results: every recorded event, an aggregated table
+/// and a Chrome trace (see Profiler)
+class ProfileResult {
+public:
+	std::vector<ProfileEvent> events;
+
+	/// per operation and phase: number of calls, total, average and maximum
+	/// time, share of the total time and bytes allocated, slowest first
+	std::string table() const
+	{
+		struct Row {
+			std::string name;
+			ProfilePhase phase;
+			std::int64_t calls = 0;
+			std::int64_t totalNs = 0;
+			std::int64_t maxNs = 0;
+			std::uint64_t bytes = 0;
+		};
+		std::map<std::pair<std::string_view, ProfilePhase>, Row> rows;
+		std::int64_t totalNs = 0;
+		for (const ProfileEvent& event : events) {
+			Row& row = rows[{event.name, event.phase}];
+			row.name = event.name;
+			row.phase = event.phase;
+			row.calls += 1;
+			row.totalNs += event.durationNs;
+			row.maxNs = std::max(row.maxNs, event.durationNs);
+			row.bytes += event.bytesAllocated;
+			totalNs += event.durationNs;
+		}
+		std::vector<Row> sorted;
+		for (const auto& [key, row] : rows) {
+			sorted.push_back(row);
+		}
+		std::ranges::sort(sorted, [](const Row& a, const Row& b) {return a.totalNs > b.totalNs;});
+
+		std::ostringstream out;
+		out << std::left << std::setw(24) << "op" << std::setw(10) << "phase" << std::right
+			<< std::setw(10) << "calls" << std::setw(14) << "total ms" << std::setw(12) << "avg us"
+			<< std::setw(12) << "max us" << std::setw(9) << "%" << std::setw(14) << "MiB alloc" << "\n";
+		out << std::fixed;
+		for (const Row& row : sorted) {
+			out << std::left << std::setw(24) << row.name
+				<< std::setw(10) << (row.phase == ProfilePhase::forward ? "forward" : "backward") << std::right
+				<< std::setw(10) << row.calls
+				<< std::setw(14) << std::setprecision(3) << row.totalNs / 1e6
+				<< std::setw(12) << std::setprecision(2) << row.totalNs / 1e3 / row.calls
+				<< std::setw(12) << row.maxNs / 1e3
+				<< std::setw(9) << std::setprecision(1) << (totalNs > 0 ? 100.0 * row.totalNs / totalNs : 0.0)
+				<< std::setw(14) << std::setprecision(2) << row.bytes / (1024.0 * 1024.0) << "\n";
+		}
+		return out.str();
+	}
+
+	/// write the events in the Chrome trace event format, which trace
+	/// viewers like chrome://tracing or Perfetto display as a timeline
+	void writeChromeTrace(std::ostream& out) const
+	{
+		out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+		for (size_t i = 0; i < events.size(); ++i) {
+			const ProfileEvent& event = events[i];
+			out << (i > 0 ? "," : "") << "\n{\"name\": \"" << event.name
+				<< "\", \"cat\": \"" << (event.phase == ProfilePhase::forward ? "forward" : "backward")
+				<< "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << event.threadId
+				<< ", \"ts\": " << event.startNs / 1000 << "." << std::setfill('0') << std::setw(3) << event.startNs % 1000
+				<< ", \"dur\": " << event.durationNs / 1000 << "." << std::setw(3) << event.durationNs % 1000 << std::setfill(' ')
+				<< ", \"args\": {\"shapes\": \"" << event.shapes << "\", \"bytes\": " << event.bytesAllocated << "}}";
+		}
+		out << "\n]}\n";
+	}
+
+	void writeChromeTrace(const std::string& path) const
+	{
+		std::ofstream out(path);
+		writeChromeTrace(out);
+		out.close();
+		if (!out) {
+			throw std::system_error(errno, std::generic_category(), "can't write " + path);
+		}
+	}
+};
+
+/// Opt-in profiler of the autograd operations. While it runs, the forward
+/// pass of every operation (autofn::Function::apply and the other ops
+/// recording a node) and every backward function run by
+/// Tensor::backward() are recorded with their shapes, wall time, thread
+/// and allocated bytes. Each thread records into its own buffer.
+/// When the profiler isn't running an operation only checks one flag.
+///
+///     autofn::Profiler::start();
+///     trainStep();
+///     autofn::ProfileResult result = autofn::Profiler::stop();
+///     std::cout << result.table();
+///     result.writeChromeTrace("trace.json");
+class Profiler {
+public:
+	static bool isEnabled() noexcept
+	{
+		return num::detail::profilerEnabled.load(std::memory_order_relaxed);
+	}
+
+	/// start recording, events of an earlier run are dropped
+	static void start()
+	{
+		detail::ProfilerState& state = detail::profilerState();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		for (const auto& buffer : state.buffers) {
+			std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+			buffer->events.clear();
+		}
+		originNs.store(nanoseconds(std::chrono::steady_clock::now()), std::memory_order_relaxed);
+		num::detail::profilerEnabled.store(true, std::memory_order_release);
+	}
+
+	/// stop recording and collect the events of all threads sorted by start
+	static ProfileResult stop()
+	{
+		num::detail::profilerEnabled.store(false, std::memory_order_release);
+		detail::ProfilerState& state = detail::profilerState();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		ProfileResult result;
+		for (const auto& buffer : state.buffers) {
+			std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+			std::ranges::move(buffer->events, std::back_inserter(result.events));
+			buffer->events.clear();
+		}
+		std::ranges::sort(result.events, [](const ProfileEvent& a, const ProfileEvent& b) {
+			return a.startNs < b.startNs;
+		});
+		return result;
+	}
+private:
+	friend class ProfileRecord;
+	/// start of the current run, the events start relative to it
+	static inline std::atomic<std::int64_t> originNs {0};
+
+	static std::int64_t nanoseconds(std::chrono::steady_clock::time_point time)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+	}
+};
+
+/// Records the lifetime of the object as an event of the profiler, the
+/// shapes can be filled in before it ends. Only create it after checking
+/// Profiler::isEnabled().
+class ProfileRecord {
+public:
+	ProfileRecord(const char* name, ProfilePhase phase)
+	  : name (name ? name : "unnamed"),
+		phase (phase),
+		startBytes (num::detail::threadAllocatedBytes),
+		start (std::chrono::steady_clock::now())
+	{}
+
+	~ProfileRecord()
+	{
+		auto end = std::chrono::steady_clock::now();
+		detail::ProfileThreadBuffer& buffer = detail::threadProfileBuffer();
+		std::int64_t startNs = Profiler::nanoseconds(start) - Profiler::originNs.load(std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(buffer.mutex);
+		buffer.events.push_back({name, phase, std::move(shapes), startNs,
+			std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+			buffer.threadId, num::detail::threadAllocatedBytes - startBytes});
+	}
+
+	ProfileRecord(const ProfileRecord&) = delete;
+	ProfileRecord& operator=(const ProfileRecord&) = delete;
+
+	std::string shapes;
+private:
+	const char* name;
+	ProfilePhase phase;
+	std::uint64_t startBytes;
+	std::chrono::steady_clock::time_point start;
+};
+
+/// shapes of inputs (anything with dims) and of the result for a ProfileEvent
+template <typename Inputs, typename Dims>
+std::string profileShapes(const Inputs& inputs, const Dims& outDims)
+{
+	std::string out;
+	for (const auto& input : inputs) {
+		out += input.dims.toString() + " ";
+	}
+	return out + "-> " + outDims.toString();
+}
+
+namespace detail {
+
+/// unqualified name of a type without template arguments, e.g. "MatMul"
+/// for autofn::MatMul<double>, computed at compile time
+template <typename Type>
+constexpr std::string_view typeNameView()
+{
+#if defined(__GNUC__) || defined(__clang__)
+	std::string_view full = __PRETTY_FUNCTION__;
+#else
+	std::string_view full;
+#endif
+	std::size_t begin = full.find("Type = ");
+	if (begin == std::string_view::npos) {
+		return "unnamed";
+	}
+	full.remove_prefix(begin + 7);
+	full = full.substr(0, full.find_first_of(";]<"));
+	std::size_t scope = full.rfind("::");
+	if (scope != std::string_view::npos) {
+		full.remove_prefix(scope + 2);
+	}
+	return full;
+}
+
+template <typename Type>
+inline constexpr auto typeNameStorage = []() {
+	constexpr std::string_view name = typeNameView<Type>();
+	std::array<char, name.size() + 1> out {};
+	std::ranges::copy(name, out.begin());
+	return out;
+}();
+
+/// typeNameView() as a null terminated string
+template <typename Type>
+constexpr const char* typeName()
+{
+	return typeNameStorage<Type>.data();
+}
+
+} // namespace detail
+
+} // namespace autofn
+
+#endif
@@ -0,0 +1,269 @@
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <array>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include "IntArrRef.h"
+#include "LoopPlan.h"
+#include "Parallel.h"
+#include "BFloat16.h"
+
+namespace num {
+
+/// sum of n elements with the given stride. Independent accumulators
+/// are combined pairwise at the end, which lets the compiler vectorize
+/// the loop and keeps rounding errors smaller than a running sum.
+/// The sum is accumulated in acc_t<T>.
+template <typename T>
+acc_t<T> treeSum(const T* src, int n, int stride)
+{
+	constexpr int lanes = 8;
+	acc_t<T> acc[lanes] = {};
+	int j = 0;
+	if (stride == 1) {
+		for (; j + lanes <= n; j += lanes) {
+			for (int l = 0; l < lanes; ++l) {
+				acc[l] += src[j + l];
+			}
+		}
+	} else {
+		for (; j + lanes <= n; j += lanes) {
+			for (int l = 0; l < lanes; ++l) {
+				acc[l] += src[(j + l) * stride];
+			}
+		}
+	}
+	for (; j < n; ++j) {
+		acc[0] += src[j * stride];
+	}
+	for (int width = lanes / 2; width > 0; width /= 2) {
+		for (int l = 0; l < width; ++l) {
+			acc[l] += acc[l + width];
+		}
+	}
+	return acc[0];
+}
+
+namespace detail {
+
+/// Runs rangeFn(begin, end, chunk) over the elements of plan where the
+/// first operand is the output of a reduction (stride 0 along reduced dims).
+/// If the outermost dimension isn't reduced the chunks are split along it
+/// and write disjoint outputs (chunk is always 0). Otherwise every chunk
+/// gets its own index so that chunks other than 0 can reduce into separate
+/// partial results, which prepare(numChunks) is called to set up first.
+/// Returns the number of chunks that need combining.
+template <size_t N, typename Prepare, typename Fn>
+std::ptrdiff_t forReductionChunks(const LoopPlan<N>& plan, const Prepare& prepare, const Fn& rangeFn)
+{
+	std::ptrdiff_t total = plan.size();
+	std::ptrdiff_t maxChunks = std::min<std::ptrdiff_t>(numThreads(), total / defaultGrainSize);
+	if (maxChunks <= 1 || num::inParallelRegion()) {
+		rangeFn(0, total, 0);
+		return 1;
+	}
+
+	if (plan.strides[0][0] != 0) {
+		std::ptrdiff_t outer = plan.dims[0];
+		std::ptrdiff_t perOuter = total / outer;
+		parallelFor(0, outer, std::max<std::ptrdiff_t>(1, defaultGrainSize / perOuter),
+			[&](std::ptrdiff_t begin, std::ptrdiff_t end) {
+				rangeFn(begin * perOuter, end * perOuter, 0);
+			});
+		return 1;
+	}
+
+	std::ptrdiff_t chunkSize = (total + maxChunks - 1) / maxChunks;
+	std::ptrdiff_t numChunks = (total + chunkSize - 1) / chunkSize;
+	prepare(numChunks);
+	parallelFor(0, numChunks, 1, [&](std::ptrdiff_t begin, std::ptrdiff_t end) {
+		for (std::ptrdiff_t chunk = begin; chunk < end; ++chunk) {
+			rangeFn(chunk * chunkSize, std::min(total, (chunk + 1) * chunkSize), chunk);
+		}
+	});
+	return numChunks;
+}
+
+/// combine the partial results 1..numParts-1 into part 0 pairwise:
+/// combine(dst, src) merges src into dst
+template <typename Combine>
+void treeCombine(std::ptrdiff_t numParts, const Combine& combine)
+{
+	for (std::ptrdiff_t step = 1; step < numParts; step *= 2) {
+		parallelFor(0, (numParts + 2 * step - 1) / (2 * step), 1, [&](std::ptrdiff_t begin, std::ptrdiff_t end) {
+			for (std::ptrdiff_t pair = begin; pair < end; ++pair) {
+				std::ptrdiff_t dst = pair * 2 * step;
+				if (dst + step < numParts) {
+					combine(dst, dst + step);
+				}
+			}
+		});
+	}
+}
+
+} // namespace detail
+
+namespace detail {
+
+/// reduceSumInto with the sums kept in Acc
+template <typename T, typename Acc>
+void reduceSumIntoAcc(
+	Acc* dst, const IntArrRef& dstStrides, std::ptrdiff_t dstSize,
+	const T* src, const IntArrRef& srcDims, const IntArrRef& srcStrides)
+{
+	LoopPlan<2> plan(srcDims, {dstStrides, srcStrides});
+	if (plan.size() == 0) {
+		return;
+	}
+	std::vector<std::vector<Acc>> partials;
+
+	auto sumRange = [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t chunk) {
+		Acc* out = dst;
+		if (chunk > 0) {
+			out = partials[chunk].data();
+		}
+		plan.forRange(begin, end, [out, src](const std::array<std::ptrdiff_t, 2>& offsets, int n, const std::array<int, 2>& innerStrides) {
+			Acc* outRow = out + offsets[0];
+			const T* srcRow = src + offsets[1];
+			if (innerStrides[0] == 0) {
+				*outRow += treeSum(srcRow, n, innerStrides[1]);
+			} else if (innerStrides[0] == 1 && innerStrides[1] == 1) {
+				for (int j = 0; j < n; ++j) {
+					outRow[j] += srcRow[j];
+				}
+			} else {
+				for (int j = 0; j < n; ++j) {
+					outRow[j * innerStrides[0]] += srcRow[j * innerStrides[1]];
+				}
+			}
+		});
+	};
+
+	// chunk 0 sums into dst directly
+	auto preparePartials = [&](std::ptrdiff_t numChunks) {
+		partials.resize(numChunks);
+		for (std::ptrdiff_t k = 1; k < numChunks; ++k) {
+			partials[k].assign(dstSize, Acc(0));
+		}
+	};
+	std::ptrdiff_t numChunks = forReductionChunks(plan, preparePartials, sumRange);
+	treeCombine(numChunks, [&](std::ptrdiff_t into, std::ptrdiff_t from) {
+		Acc* out = (into == 0) ? dst : partials[into].data();
+		const Acc* part = partials[from].data();
+		for (std::ptrdiff_t i = 0; i < dstSize; ++i) {
+			out[i] += part[i];
+		}
+	});
+}
+
+} // namespace detail
+
+/// dst += src summed over the reduced dimensions.
+/// dst is contiguous with dstSize elements and dstStrides are its strides
+/// as seen from src: 0 along every dimension that is summed over.
+/// The sum is parallel either over independent outputs or over chunks of
+/// the input whose partial sums are combined pairwise. Narrow types are
+/// summed in acc_t<T> and only rounded when written to dst.
+template <typename T>
+void reduceSumInto(
+	T* dst, const IntArrRef& dstStrides, std::ptrdiff_t dstSize,
+	const T* src, const IntArrRef& srcDims, const IntArrRef& srcStrides)
+{
+	using Acc = acc_t<T>;
+	if constexpr (std::is_same_v<Acc, T>) {
+		detail::reduceSumIntoAcc(dst, dstStrides, dstSize, src, srcDims, srcStrides);
+	} else {
+		std::vector<Acc> sums(dst, dst + dstSize);
+		detail::reduceSumIntoAcc(sums.data(), dstStrides, dstSize, src, srcDims, srcStrides);
+		std::copy(sums.begin(), sums.end(), dst);
+	}
+}
+
+/// Reduce src to the element preferred by better(a, b) (e.g. std::greater
+/// for the maximum) over the reduced dimensions. dst and dstIdx are
+/// contiguous with dstSize elements and dstStrides as in reduceSumInto.
+/// dstIdx receives the row-major index into src of the selected element,
+/// the first one if several are equal. Every output needs at least one
+/// input element.
+template <typename T, typename Better>
+void reduceSelectInto(
+	T* dst, std::ptrdiff_t* dstIdx, const IntArrRef& dstStrides, std::ptrdiff_t dstSize,
+	const T* src, const IntArrRef& srcDims, const IntArrRef& srcStrides,
+	const IntArrRef& srcLinearStrides, Better better)
+{
+	LoopPlan<3> plan(srcDims, {dstStrides, srcStrides, srcLinearStrides});
+	if (plan.size() == 0) {
+		return;
+	}
+	std::vector<std::vector<T>> partialVals;
+	std::vector<std::vector<std::ptrdiff_t>> partialIdcs;
+
+	auto selectRange = [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t chunk) {
+		T* vals = dst;
+		std::ptrdiff_t* idcs = dstIdx;
+		if (chunk > 0) {
+			vals = partialVals[chunk].data();
+			idcs = partialIdcs[chunk].data();
+		}
+		plan.forRange(begin, end, [vals, idcs, src, &better](const std::array<std::ptrdiff_t, 3>& offsets, int n, const std::array<int, 3>& innerStrides) {
+			const T* srcRow = src + offsets[1];
+			if (innerStrides[0] == 0) {
+				// scan the row before touching the output
+				int bestJ = 0;
+				T best = srcRow[0];
+				for (int j = 1; j < n; ++j) {
+					if (better(srcRow[j * innerStrides[1]], best)) {
+						best = srcRow[j * innerStrides[1]];
+						bestJ = j;
+					}
+				}
+				std::ptrdiff_t o = offsets[0];
+				if (idcs[o] < 0 || better(best, vals[o])) {
+					vals[o] = best;
+					idcs[o] = offsets[2] + static_cast<std::ptrdiff_t>(bestJ) * innerStrides[2];
+				}
+			} else {
+				for (int j = 0; j < n; ++j) {
+					std::ptrdiff_t o = offsets[0] + static_cast<std::ptrdiff_t>(j) * innerStrides[0];
+					T val = srcRow[j * innerStrides[1]];
+					if (idcs[o] < 0 || better(val, vals[o])) {
+						vals[o] = val;
+						idcs[o] = offsets[2] + static_cast<std::ptrdiff_t>(j) * innerStrides[2];
+					}
+				}
+			}
+		});
+	};
+
+	// -1 marks outputs that haven't seen an element yet
+	std::fill_n(dstIdx, dstSize, -1);
+	auto preparePartials = [&](std::ptrdiff_t numChunks) {
+		partialVals.resize(numChunks);
+		partialIdcs.resize(numChunks);
+		for (std::ptrdiff_t k = 1; k < numChunks; ++k) {
+			partialVals[k].resize(dstSize);
+			partialIdcs[k].assign(dstSize, -1);
+		}
+	};
+	std::ptrdiff_t numChunks = detail::forReductionChunks(plan, preparePartials, selectRange);
+	detail::treeCombine(numChunks, [&](std::ptrdiff_t into, std::ptrdiff_t from) {
+		T* vals = (into == 0) ? dst : partialVals[into].data();
+		std::ptrdiff_t* idcs = (into == 0) ? dstIdx : partialIdcs[into].data();
+		// later chunks only win if strictly better to keep the first index
+		for (std::ptrdiff_t i = 0; i < dstSize; ++i) {
+			std::ptrdiff_t otherIdx = partialIdcs[from][i];
+			if (otherIdx >= 0 && (idcs[i] < 0 || better(partialVals[from][i], vals[i]))) {
+				vals[i] = partialVals[from][i];
+				idcs[i] = otherIdx;
+			}
+		}
+	});
+}
+
+} // namespace num
+
+#endif
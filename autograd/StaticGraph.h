@@ -0,0 +1,263 @@
+#ifndef STATIC_GRAPH_H
+#define STATIC_GRAPH_H
+
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Tensor.h"
+#include "GradMode.h"
+#include "Storage.h"
+#include "NumErrors.h"
+
+namespace autofn {
+
+namespace detail {
+
+/// sets a thread local pointer for its lifetime
+/// and restores the previous value afterwards
+template <typename P>
+class ScopedPointer {
+public:
+	ScopedPointer(P*& slot, P* value)
+	  : slot (slot), prev (slot)
+	{
+		slot = value;
+	}
+
+	~ScopedPointer()
+	{
+		slot = prev;
+	}
+
+	ScopedPointer(const ScopedPointer&) = delete;
+	ScopedPointer& operator=(const ScopedPointer&) = delete;
+private:
+	P*& slot;
+	P* prev;
+};
+
+/// op recorded while a StaticGraph is captured
+template <num::num_t T>
+struct ForwardInstruction {
+	std::function<num::Tensor<T>(const std::vector<num::Tensor<T>>&)> forward;
+	std::vector<num::Tensor<T>> inputs;
+	/// the result of the op when it was captured,
+	/// replays write their results into its buffer
+	num::Tensor<T> out;
+	num::BufferTape<T> tape;
+};
+
+/// ops recorded by the thread capturing a StaticGraph
+template <num::num_t T>
+struct ForwardTrace {
+	static inline thread_local ForwardTrace<T>* active = nullptr;
+	std::vector<ForwardInstruction<T>> instructions;
+};
+
+} // namespace detail
+
+/// Returns forward(inputs). While a StaticGraph is captured the call is
+/// also recorded as an instruction that is run again on replay, so ops
+/// call this around their forward pass. Ops used from within forward
+/// belong to the instruction and aren't recorded themselves.
+template <num::num_t T, typename Forward>
+num::Tensor<T> tracedForward(const std::vector<num::Tensor<T>>& inputs, const Forward& forward)
+{
+	detail::ForwardTrace<T>* trace = detail::ForwardTrace<T>::active;
+	if (!trace) {
+		return forward(inputs);
+	}
+
+	num::BufferTape<T> tape;
+	tape.startRecording();
+	num::Tensor<T> out = [&]() {
+		detail::ScopedPointer<detail::ForwardTrace<T>> pauseTrace(detail::ForwardTrace<T>::active, nullptr);
+		detail::ScopedPointer<num::BufferTape<T>> useTape(num::BufferTape<T>::active, &tape);
+		return forward(inputs);
+	}();
+
+	// the instruction must not keep the autograd graph alive
+	std::vector<num::Tensor<T>> detachedInputs;
+	detachedInputs.reserve(inputs.size());
+	for (const num::Tensor<T>& input : inputs) {
+		detachedInputs.push_back(input.detach());
+	}
+	trace->instructions.push_back({forward, std::move(detachedInputs), out.detach(), std::move(tape)});
+	return out;
+}
+
+/// Trace once, replay many times: a training (or inference) step for
+/// inputs of fixed shapes captured into a flat list of instructions.
+///
+/// The constructor runs step once on copies of the example inputs and
+/// records every op of its forward pass, the backward functions of the
+/// resulting graph in topological order and the optimizer update.
+/// replay() copies new input data into the captured inputs and runs
+/// the instructions again on the same buffers: no autograd graph is
+/// built or sorted and the buffers of every instruction are reused.
+///
+/// Only autofn ops (Functions, reductions and fused expressions) are
+/// replayed, other Tensors created by step are constants of the graph.
+/// The Tensor returned by replay() is overwritten by the next replay.
+template <num::num_t T>
+class StaticGraph {
+public:
+	using StepFn = std::function<num::Tensor<T>(const std::vector<num::Tensor<T>>&)>;
+
+	/// Capture step without an optimizer. If its result requires a
+	/// gradient every replay runs the backward pass, which accumulates
+	/// into the gradients of the leaves like backward() does.
+	StaticGraph(const std::vector<num::Tensor<T>>& exampleInputs, const StepFn& step)
+	  : StaticGraph(exampleInputs, step, nullptr, nullptr)
+	{}
+
+	/// capture step followed by optimizer.zeroGradient(), the backward
+	/// pass and optimizer.step()
+	template <typename Optimizer>
+	StaticGraph(const std::vector<num::Tensor<T>>& exampleInputs, const StepFn& step, Optimizer& optimizer)
+	  : StaticGraph(exampleInputs, step,
+			[&optimizer]() {optimizer.zeroGradient();},
+			[&optimizer]() {optimizer.step();})
+	{}
+
+	StaticGraph(const StaticGraph&) = delete;
+	StaticGraph& operator=(const StaticGraph&) = delete;
+
+	/// run the captured step on inputs of the same shapes as the
+	/// example inputs and return its result
+	const num::Tensor<T>& replay(const std::vector<num::Tensor<T>>& newInputs)
+	{
+		if (newInputs.size() != inputs.size()) {
+			throw std::invalid_argument("captured step takes " + std::to_string(inputs.size())
+				+ " inputs but got " + std::to_string(newInputs.size()));
+		}
+		for (size_t i = 0; i < inputs.size(); ++i) {
+			if (newInputs[i].dims != inputs[i].dims) {
+				throw num::ShapeMismatchError("captured step needs input of shape " + inputs[i].dims.toString()
+					+ " but got " + newInputs[i].dims.toString());
+			}
+			num::Tensor<T>::copy(newInputs[i], inputs[i]);
+		}
+
+		{
+			NoGradGuard noGrad;
+			for (detail::ForwardInstruction<T>& instruction : forwardInstructions) {
+				instruction.tape.rewind();
+				detail::ScopedPointer<num::BufferTape<T>> useTape(num::BufferTape<T>::active, &instruction.tape);
+				num::Tensor<T> fresh = instruction.forward(instruction.inputs);
+				// only differs if the op allocated differently than when captured
+				if (fresh.data() != instruction.out.data()) {
+					num::Tensor<T>::copy(fresh, instruction.out);
+				}
+			}
+		}
+		if (out.requiresGrad()) {
+			runBackward(false);
+		}
+		return out;
+	}
+
+	/// result of the last run of the step
+	const num::Tensor<T>& output() const noexcept
+	{
+		return out;
+	}
+
+	/// number of recorded forward ops and backward functions
+	size_t numInstructions() const noexcept
+	{
+		return forwardInstructions.size() + backwardInstructions.size();
+	}
+private:
+	struct BackwardInstruction {
+		num::Tensor<T> node;
+		num::BufferTape<T> tape;
+	};
+
+	std::vector<num::Tensor<T>> inputs;
+	std::vector<detail::ForwardInstruction<T>> forwardInstructions;
+	std::vector<BackwardInstruction> backwardInstructions;
+	std::function<void()> zeroGradient;
+	std::function<void()> updateParameters;
+	num::Tensor<T> out;
+	/// gradient the backward pass starts with
+	num::Tensor<T> seed;
+
+	StaticGraph(
+		const std::vector<num::Tensor<T>>& exampleInputs, const StepFn& step,
+		std::function<void()> zeroGradient, std::function<void()> updateParameters)
+	  : inputs (copyInputs(exampleInputs)),
+		zeroGradient (std::move(zeroGradient)),
+		updateParameters (std::move(updateParameters)),
+		out (trace(step)),
+		seed (num::ones<T>(out.dims))
+	{
+		if (!out.requiresGrad()) {
+			return;
+		}
+		std::vector<num::Tensor<T>> sorted = out.topologicalOrder();
+		for (auto node = sorted.rbegin(); node != sorted.rend(); ++node) {
+			// leaves only accumulate
+			if (node->autograd->backwardFn) {
+				backwardInstructions.push_back({std::move(*node), {}});
+			}
+		}
+		runBackward(true);
+	}
+
+	static std::vector<num::Tensor<T>> copyInputs(const std::vector<num::Tensor<T>>& exampleInputs)
+	{
+		std::vector<num::Tensor<T>> copies;
+		for (const num::Tensor<T>& input : exampleInputs) {
+			copies.push_back(input.detach().clone());
+		}
+		return copies;
+	}
+
+	num::Tensor<T> trace(const StepFn& step)
+	{
+		detail::ForwardTrace<T> forwardTrace;
+		num::Tensor<T> result = [&]() {
+			detail::ScopedPointer<detail::ForwardTrace<T>> useTrace(detail::ForwardTrace<T>::active, &forwardTrace);
+			return step(inputs);
+		}();
+		forwardInstructions = std::move(forwardTrace.instructions);
+		return result;
+	}
+
+	/// backward pass over the recorded nodes and parameter update,
+	/// recording the buffers of every backward function on the first run
+	void runBackward(bool record)
+	{
+		if (zeroGradient) {
+			zeroGradient();
+		}
+		{
+			NoGradGuard noGrad;
+			// gradients of intermediate results start from zero every time
+			for (BackwardInstruction& instruction : backwardInstructions) {
+				instruction.node.zeroGradient();
+			}
+			out.setGradient(seed);
+			for (BackwardInstruction& instruction : backwardInstructions) {
+				if (record) {
+					instruction.tape.startRecording();
+				} else {
+					instruction.tape.rewind();
+				}
+				detail::ScopedPointer<num::BufferTape<T>> useTape(num::BufferTape<T>::active, &instruction.tape);
+				num::Tensor<T>::runBackwardFn(instruction.node, true);
+			}
+		}
+		if (updateParameters) {
+			updateParameters();
+		}
+	}
+};
+
+} // namespace autofn
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "Allocator.h"
+
+namespace num {
+
+/// Buffers allocated by one instruction of a captured graph (see
+/// autofn::StaticGraph). While recording, every Storage allocated by
+/// the thread using the tape gets a new buffer that is kept. When the
+/// instruction is replayed the same buffers are handed out again in the
+/// same order (zeroed like fresh ones) instead of allocating.
+template <typename T>
+class BufferTape {
+public:
+	/// tape that Storages allocated by this thread take their buffers from
+	static inline thread_local BufferTape<T>* active = nullptr;
+
+	void startRecording()
+	{
+		buffers.clear();
+		recording = true;
+	}
+
+	/// replay the recorded buffers from the first one on
+	void rewind() noexcept
+	{
+		next = 0;
+		recording = false;
+	}
+
+	std::shared_ptr<T[]> allocate(std::size_t size)
+	{
+		if (recording) {
+			buffers.emplace_back(size, makeAlignedBuffer<T>(size));
+			return buffers.back().second;
+		}
+		if (next < buffers.size() && buffers[next].first == size) {
+			const std::shared_ptr<T[]>& buffer = buffers[next++].second;
+			std::fill_n(buffer.get(), size, T(0));
+			return buffer;
+		}
+		// the instruction took another path than when it was recorded
+		return makeAlignedBuffer<T>(size);
+	}
+private:
+	std::vector<std::pair<std::size_t, std::shared_ptr<T[]>>> buffers;
+	std::size_t next = 0;
+	bool recording = false;
+};
+
+/// Elements of a Tensor shared by all of its copies and views.
+/// The buffer sits behind this extra indirection so that it can be
+/// moved (e.g. into a parameter arena) without invalidating any of them.
+template <typename T>
+class Storage {
+public:
+	/// zero initialised storage of size elements from the current allocator
+	explicit Storage(std::size_t size)
+	  : buffer (BufferTape<T>::active ? BufferTape<T>::active->allocate(size) : makeAlignedBuffer<T>(size)),
+		sz (size)
+	{}
+
+	/// storage using buffer of size elements without copying it
+	Storage(std::shared_ptr<T[]> buffer, std::size_t size)
+	  : buffer (std::move(buffer)), sz (size)
+	{}
+
+	Storage(const Storage&) = delete;
+	Storage& operator=(const Storage&) = delete;
+
+	T* data() const noexcept
+	{
+		return buffer.get();
+	}
+
+	std::size_t size() const noexcept
+	{
+		return sz;
+	}
+
+	/// copy the contents to newBuffer (with room for size() elements)
+	/// and use it from now on
+	void relocate(std::shared_ptr<T[]> newBuffer)
+	{
+		std::copy_n(buffer.get(), sz, newBuffer.get());
+		buffer = std::move(newBuffer);
+	}
+private:
+	std::shared_ptr<T[]> buffer;
+	std::size_t sz;
+};
+
+} // namespace num
+
+#endif
@@ -11,46 +11,127 @@
 #include <memory>
 #include <optional>
 #include <cmath>
-#include <set>
 #include <ranges>
 #include <concepts>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <exception>
 
 namespace num {
 template <typename T>
 concept num_t = std::convertible_to<T, double>;
+
+// define NUM_KERNEL_BOUNDS_CHECK to also bounds check every
+// element access done internally by the Tensor kernels
+#ifdef NUM_KERNEL_BOUNDS_CHECK
+inline constexpr bool kernelBoundsCheck = true;
+#else
+inline constexpr bool kernelBoundsCheck = false;
+#endif
 }
 
+#include "BFloat16.h"
 #include "TensorFactory.h"
 #include "IntArrRef.h"
 #include "Slice.h"
 #include "NumErrors.h"
+#include "GradMode.h"
+#include "Storage.h"
+#include "Parallel.h"
+#include "LoopPlan.h"
+#include "Reduce.h"
+#include "Profiler.h"
+
+namespace autofn {
+template <num::num_t T>
+class StaticGraph;
+}
 
 namespace num {
 
+template <num_t T>
+class Tensor;
+
+/// Autograd state of a Tensor that requires a gradient.
+/// It is shared by all copies (and reshaped views) of that Tensor.
+template <num_t T>
+struct AutogradMeta {
+	/// allocated on first accumulation, contiguous in the order of dims
+	std::shared_ptr<T[]> grad;
+	/// guards grad against concurrent accumulation by a parallel backward pass
+	std::mutex gradMutex;
+	/// empty for leaves
+	std::function<void(const Tensor<T>&, const std::vector<Tensor<T>>&)> backwardFn;
+	/// inputs of the operation that created the Tensor
+	std::vector<Tensor<T>> gradGraphChildren;
+	/// name of that operation for the profiler
+	const char* opName = nullptr;
+	/// set once backward() dropped backwardFn and gradGraphChildren
+	bool graphFreed = false;
+	/// marks the node as visited by the backward pass with that epoch
+	std::uint64_t visitEpoch = 0;
+
+	/// every backward pass takes a new epoch so visited marks never need resetting
+	static inline std::atomic<std::uint64_t> nextEpoch {1};
+
+	AutogradMeta() = default;
+	AutogradMeta(const AutogradMeta&) = delete;
+	AutogradMeta& operator=(const AutogradMeta&) = delete;
+
+	/// releases the graph below iteratively so that destroying
+	/// a long chain doesn't overflow the stack
+	~AutogradMeta()
+	{
+		std::vector<Tensor<T>> pending = std::move(gradGraphChildren);
+		while (!pending.empty()) {
+			Tensor<T> child = std::move(pending.back());
+			pending.pop_back();
+			// nodes still referenced elsewhere stay intact
+			if (child.autograd && child.autograd.use_count() == 1) {
+				for (Tensor<T>& grandChild : child.autograd->gradGraphChildren) {
+					pending.push_back(std::move(grandChild));
+				}
+				child.autograd->gradGraphChildren.clear();
+			}
+		}
+	}
+};
+
 
 // n-dimensional array
 template <num_t T>
 class Tensor {
+	friend struct AutogradMeta<T>;
+	friend class autofn::StaticGraph<T>;
 public:
 	using size_type = size_t;
 	IntArrRef dims;
-	std::function<void(const Tensor<T>&, const std::vector<Tensor<T>>&)> backwardFn;
-	std::vector<Tensor<T>> gradGraphChildren;
+	/// number of elements to skip in the storage to move by one
+	/// along each dimension
+	IntArrRef strides;
 private:
-	std::shared_ptr<T[]> arr;
-	std::shared_ptr<T[]> gradArr;
+	std::shared_ptr<Storage<T>> storage;
+	// null unless the Tensor requires a gradient
+	std::shared_ptr<AutogradMeta<T>> autograd;
+	/// position of the first element inside of storage
+	size_type offset;
 	size_type sz;
 public:
+	/// zero initialised Tensor
+	Tensor(const IntArrRef& dimensions)
+	  : Tensor(dimensions, std::initializer_list<T>{})
+	{}
+
 	Tensor(
             const IntArrRef& dimensions,
             std::function<T(const IntArrRef&)> fillFn
-                = [](const IntArrRef& idx) -> T { return 0; }
     ) : dims {dimensions.clone()},
-	  	backwardFn (
-                [](const Tensor<T>& grad, const std::vector<Tensor<T>>& oldInputs)
-                    {return;}
-            ),
-		gradGraphChildren ({})
+		strides {contiguousStrides(dimensions)},
+		offset (0)
 	{
 		if (dimensions.size() == 0) {
 			throw std::invalid_argument("need at least one dimension");
@@ -63,12 +144,12 @@ public:
 			}
 			sz *= dim;
 		}
-		arr = std::make_shared<T[]>(sz);
-		gradArr = std::make_shared<T[]>(sz);
+		storage = std::make_shared<Storage<T>>(sz);
 
+		// freshly allocated so the linear index is the storage index
 		IntArrRef idx(dims.size());
-		for (int dimCarries = 0; dimCarries < dims.size(); dimCarries = idxIncr(idx)) {
-			setSingle(fillFn(idx), idx);
+		for (int i = 0; i < sz; ++i, idxIncr(idx)) {
+			storage->data()[i] = fillFn(idx);
 		}
 	}
 
@@ -76,11 +157,8 @@ public:
             const IntArrRef& dimensions,
             std::initializer_list<T> els
     ) : dims {dimensions.clone()},
-	  	backwardFn (
-                [](const Tensor<T>& grad, const std::vector<Tensor<T>>& oldInputs)
-                    {return;}
-            ),
-		gradGraphChildren ({})
+		strides {contiguousStrides(dimensions)},
+		offset (0)
 	{
 		if (dimensions.size() == 0) {
 			throw std::invalid_argument("need at least one dimension");
@@ -93,22 +171,37 @@ public:
 			}
 			sz *= dim;
 		}
-		arr = std::make_shared<T[]>(sz);
-		gradArr = std::make_shared<T[]>(sz);
+		storage = std::make_shared<Storage<T>>(sz);
 
-		for (int i = 0; i < sz; ++i) {
-            arr[i] = *(els.begin() + i);
-		}
+		// remaining elements stay zero
+		std::copy_n(els.begin(), std::min(els.size(), sz), storage->data());
 	}
 
 
 	Tensor(T val)
-	  : dims ({1}), arr (std::make_shared<T[]>(1)), sz (1),
-	    gradArr (std::make_shared<T[]>(1)),
-	  	gradGraphChildren ({}),
-	  	backwardFn ([](const Tensor<T>& grad, const std::vector<Tensor<T>>& oldInputs) {return;})
+	  : dims ({1}), strides ({1}), storage (std::make_shared<Storage<T>>(1)), offset (0), sz (1)
+	{
+		storage->data()[0] = val;
+	}
+
+	/// scalar of another arithmetic type, e.g. Tensor<bfloat16>(2)
+	template <typename U> requires (std::is_arithmetic_v<U> && !std::same_as<U, T>)
+	Tensor(U val)
+	  : Tensor(static_cast<T>(val))
+	{}
+
+	/// Tensor with the given dims using buffer as its contiguous
+	/// storage without copying it
+	static Tensor<T> fromBuffer(const IntArrRef& dimensions, std::shared_ptr<T[]> buffer)
 	{
-		arr[0] = val;
+		size_type size = 1;
+		for (int dim : dimensions) {
+			if (dim < 0) {
+				throw std::invalid_argument("can't have negative dimension");
+			}
+			size *= dim;
+		}
+		return Tensor<T>(std::make_shared<Storage<T>>(std::move(buffer), size), dimensions, size);
 	}
 
 	~Tensor() = default;	
@@ -121,20 +214,55 @@ public:
 
 	Tensor<T>& operator=(Tensor<T>&& other) = default;
 
+	bool requiresGrad() const noexcept
+	{
+		return autograd != nullptr;
+	}
+
+	/// Tensors only get gradients and are recorded in the autograd
+	/// graph if they require a gradient.
+	/// Turning it off only detaches this copy from the shared gradient.
+	Tensor<T>& setRequiresGrad(bool requiresGrad = true)
+	{
+		if (!requiresGrad) {
+			autograd.reset();
+		} else if (!autograd) {
+			autograd = std::make_shared<AutogradMeta<T>>();
+		}
+		return *this;
+	}
+
+	/// make this Tensor the output of a differentiable operation
+	/// with the given inputs, used by autofn::Function
+	void setGradFn(
+		std::function<void(const Tensor<T>&, const std::vector<Tensor<T>>&)> backwardFn,
+		std::vector<Tensor<T>> inputs,
+		const char* opName = nullptr)
+	{
+		autograd = std::make_shared<AutogradMeta<T>>();
+		autograd->backwardFn = std::move(backwardFn);
+		autograd->gradGraphChildren = std::move(inputs);
+		autograd->opName = opName;
+	}
+
 	void zeroGradient() noexcept
 	{
-		for (int i = 0; i < sz; ++i) {
-			gradArr[i] = 0;
+		if (autograd && autograd->grad) {
+			std::fill_n(autograd->grad.get(), sz, T(0));
 		}
 	}
 
-	Tensor<T> getGradient() const noexcept
+	/// copy of the accumulated gradient (zeros if there is none)
+	Tensor<T> getGradient() const
 	{
-		Tensor<T> out(this->clone());
-		out.arr = out.gradArr;
+		Tensor<T> out(dims);
+		if (autograd && autograd->grad) {
+			std::copy_n(autograd->grad.get(), sz, out.data());
+		}
 		return out;
 	}
 
+	/// add grad to the gradient, does nothing if no gradient is required
 	void setGradient(const Tensor<T>& grad)
 	{
 		if (grad.dims != dims) {
@@ -142,143 +270,357 @@ public:
 									 "Got gradient of dim " + grad.dims.toString() +
 									 "but want dimensions " + dims.toString());
 		}
-
-		for (int i = 0; i < sz; ++i) {
-			gradArr[i] += grad.arr[i];
+		if (!requiresGrad()) {
+			return;
 		}
+
+		std::lock_guard<std::mutex> lock(autograd->gradMutex);
+		T* dst = gradientBuffer();
+		const T* src = grad.data();
+		LoopPlan<2> plan(dims, {contiguousStrides(dims), grad.strides});
+		plan.parallelForEachRow(defaultGrainSize, [dst, src](const std::array<std::ptrdiff_t, 2>& offsets, int n, const std::array<int, 2>& innerStrides) {
+			T* dstRow = dst + offsets[0];
+			const T* srcRow = src + offsets[1];
+			if (innerStrides[1] == 1) {
+				for (int j = 0; j < n; ++j) {
+					dstRow[j] += srcRow[j];
+				}
+			} else {
+				for (int j = 0; j < n; ++j) {
+					dstRow[j] += srcRow[j * innerStrides[1]];
+				}
+			}
+		});
 	}
 
+	/// accumulate the gradient of an output that this Tensor was broadcast to
+	/// by summing up all entries that stem from the same element.
+	/// The sum goes straight into the gradient buffer (see reduceSumInto)
+	/// without temporaries or recording anything in the autograd graph.
 	void setBroadcastGradient(const num::Tensor<T>& gradient)
 	{
-		IntArrRef inputDims = dims.pad(gradient.dims.size());
-		if (inputDims.lessThan(gradient.dims, std::nullopt)) {
-			Tensor<T> newGrad = zeros<T>(inputDims);
-			gradient.iter(
-				[&newGrad](const IntArrRef& _, const Tensor<T>& gradIter) {
-					newGrad = newGrad + gradIter;
-				},
-				0);
-			setGradient(newGrad.reshape(newGrad.dims.pad(dims.size())));
-		} else {
+		if (!requiresGrad()) {
+			return;
+		}
+		if (gradient.dims == dims) {
+			setGradient(gradient);
+			return;
+		}
+		if (gradient.sz == sz) {
 			setGradient(gradient.reshape(dims));
+			return;
+		}
+		int numDimsDiff = gradient.dims.size() - dims.size();
+		if (numDimsDiff < 0) {
+			throw ShapeMismatchError("can't reduce gradient of shape " + gradient.dims.toString()
+				+ " to shape " + dims.toString());
 		}
+
+		// strides of the gradient buffer as seen from the incoming
+		// gradient: 0 along every dimension that was broadcast
+		IntArrRef gradStrides(gradient.dims.size(), 0);
+		IntArrRef ownStrides = contiguousStrides(dims);
+		for (int i = numDimsDiff; i < gradient.dims.size(); i++) {
+			int dim = dims[i - numDimsDiff];
+			if (dim == gradient.dims[i]) {
+				gradStrides[i] = ownStrides[i - numDimsDiff];
+			} else if (dim != 1) {
+				throw ShapeMismatchError("can't reduce gradient of shape " + gradient.dims.toString()
+					+ " to shape " + dims.toString());
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(autograd->gradMutex);
+		reduceSumInto(gradientBuffer(), gradStrides, sz, gradient.data(), gradient.dims, gradient.strides);
 	}
 
-	void backward()
+	/// Call fn with the contiguous gradient buffer (allocated zero
+	/// initialised on first use) while holding the gradient lock, for
+	/// kernels that accumulate into it directly instead of through
+	/// a temporary. Does nothing if no gradient is required.
+	template <typename Fn>
+	void accumulateGradient(const Fn& fn)
 	{
-		// use topological sort to create directed graph
-		std::vector<Tensor<T>> sorted;
-		std::set<std::shared_ptr<T[]>> visited;
-
-        // declare it first to be able to use it recursively
-		std::function<void(const Tensor<T>&)> topologicalSort;
-		topologicalSort =
-			[&sorted, &visited, &topologicalSort](const Tensor<T>& arr) -> void {
-				if (!(visited.contains(arr.arr))) {
-					visited.insert(arr.arr);
-					for (const Tensor<T>& child : arr.gradGraphChildren) {
-						topologicalSort(child);
-					}
-					sorted.push_back(arr);
-				}
-			};
-		
+		if (!requiresGrad()) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(autograd->gradMutex);
+		fn(gradientBuffer());
+	}
+
+	/// Accumulate the gradient of this Tensor with respect to every Tensor
+	/// of the autograd graph below it that requires a gradient.
+	/// Unless retainGraph is set the graph is freed on the way, i.e. every
+	/// node drops its inputs and backward function once they were used.
+	void backward(bool retainGraph = false)
+	{
+		backward(ones<T>(dims), retainGraph);
+	}
+
+	/// backward pass starting with the given gradient of this Tensor
+	/// instead of ones, e.g. the gradient of a loss computed later on
+	void backward(const Tensor<T>& gradient, bool retainGraph = false)
+	{
+		if (!requiresGrad()) {
+			throw std::logic_error("can't call backward on a Tensor that doesn't require a gradient");
+		}
 
-		topologicalSort(*this);
+		std::vector<Tensor<T>> sorted = topologicalOrder();
 
-		setGradient(ones<T>(dims));
+		// computing gradients doesn't need to be recorded
+		autofn::NoGradGuard noGrad;
+		setGradient(gradient);
 
-		for (const Tensor<T>& t : sorted | std::views::reverse) {
-			t.backwardFn(t.getGradient(), t.gradGraphChildren);
+		if (threadPool().size() > 0 && backwardWork(sorted) >= parallelBackwardMinElements) {
+			runBackwardParallel(sorted, retainGraph);
+			return;
+		}
+		for (Tensor<T>& entry : sorted | std::views::reverse) {
+			// our reference is dropped after this iteration so with a freed
+			// graph the node is released as soon as it was processed
+			Tensor<T> node = std::move(entry);
+			runBackwardFn(node, retainGraph);
 		}
 	}
 
-	// TODO needs to be able to handle negative values as indices
-	/// Outputs the Tensor that corresponds to the given slice indeces
+	// TODO needs to be able to handle negative values in slices
+	/// Outputs the Tensor that corresponds to the given slice indeces.
+	/// The result is a view sharing its contents with this Tensor.
 	Tensor<T> get(std::initializer_list<IdxSel> idcs) const
 	{
-		std::vector<std::tuple<int,int,int>> srcRanges;
-		std::vector<std::tuple<int,int,int>> dstRanges;
-		std::vector<int> outDims;
-		int totalSize;
-		try {
-			std::tie(srcRanges, dstRanges, outDims, totalSize) = Tensor::getCopyRanges(*this, *this, idcs);
-		} catch (ShapeMismatchError err) {
+		if (idcs.size() > dims.size()) {
 			throw ShapeMismatchError{"can't get given slice from array of shape " + dims.toString()};
 		}
 
-		Tensor<T> out(outDims);
+		std::vector<std::tuple<int,int,int>> ranges;
+		for (int i = 0; i < dims.size(); i++) {
+			if (i < idcs.size()) {
+				IdxSel idxS = *(idcs.begin() + i);
+				if (std::holds_alternative<Slice>(idxS)) {
+					ranges.push_back(std::get<Slice>(idxS).toRangeTuple(dims.at(i)));
+				} else {
+					int idx = std::get<int>(idxS);
+					// negative indeces mean index from back of array
+					idx = (idx >= 0) ? idx : (dims.at(i) + idx);
+					ranges.push_back({idx, idx+1, 1});
+				}
+			} else {
+				ranges.push_back({0, dims.at(i), 1});
+			}
+		}
+		return slice(ranges);
+	}
+
+	void set(Tensor<T> val, std::initializer_list<IdxSel> idcs)
+	{
+		Tensor<T> dst = get(idcs);
+		if (dst.dims != val.dims) {
+			throw ShapeMismatchError{"can't set given slice with array of shape " + val.dims.toString()};
+		}
+		copy(val, dst);
+	}
+
+	/// pointer to the first element, the others are found through strides
+	T* data() const noexcept
+	{
+		return storage->data() + offset;
+	}
+
+	/// total number of elements
+	size_type size() const noexcept
+	{
+		return sz;
+	}
 
-		copy(*this, out, srcRanges, dstRanges, totalSize);
+	/// strides of a row-major Tensor with the given dims
+	static IntArrRef contiguousStrides(const IntArrRef& dims)
+	{
+		IntArrRef out(dims.size(), 1);
+		for (int i = dims.size() - 2; i >= 0; --i) {
+			out[i] = out.at(i+1) * dims.at(i+1);
+		}
 		return out;
 	}
 
+	/// pointer to the contiguous gradient or nullptr if nothing
+	/// has been accumulated into it yet
+	T* gradData() const noexcept
+	{
+		return autograd ? autograd->grad.get() : nullptr;
+	}
+
+	/// number of elements in the storage shared with copies and views
+	size_type storageSize() const noexcept
+	{
+		return storage->size();
+	}
 
-	void set(Tensor<T> val, std::initializer_list<IdxSel> idcs)
+	/// Move the storage into buffer (with room for storageSize() elements).
+	/// All copies and views of this Tensor use buffer from now on.
+	void relocate(std::shared_ptr<T[]> buffer)
 	{
-		std::vector<std::tuple<int,int,int>> srcRanges;
-		std::vector<std::tuple<int,int,int>> dstRanges;
-		int totalSize;
-		try {
-			std::vector<int> ignore;
-			std::tie(srcRanges, dstRanges, ignore, totalSize) = Tensor::getCopyRanges(val, *this, idcs);
-		} catch (ShapeMismatchError err) {
-			throw ShapeMismatchError{"can't set given slice with array of shape " + val.dims.toString()};
+		storage->relocate(std::move(buffer));
+	}
+
+	/// Use buffer (with room for size() elements) as gradient storage.
+	/// A gradient accumulated so far is copied into it.
+	void relocateGradient(std::shared_ptr<T[]> buffer)
+	{
+		if (!requiresGrad()) {
+			throw std::logic_error("can't relocate the gradient of a Tensor that doesn't require one");
+		}
+		if (autograd->grad) {
+			std::copy_n(autograd->grad.get(), sz, buffer.get());
 		}
-		copy(val, *this, dstRanges, srcRanges, totalSize);
+		autograd->grad = std::move(buffer);
 	}
 
-	template <typename U>
-	friend Tensor<U> applyBinaryWithBroadcast(const Tensor<U>& a, const Tensor<U>& b, auto fn);
-	
+	/// view sharing the contents but neither the gradient nor
+	/// the autograd graph with this Tensor
+	Tensor<T> detach() const
+	{
+		return detachedView();
+	}
 
+	/// copy that is always contiguous and owns its contents.
+	/// If this Tensor requires a gradient the copy is a new leaf
+	/// starting with a copy of the gradient.
 	Tensor<T> clone() const
 	{
-		Tensor<T> out(*this);
-		out.arr = std::make_shared<T[]>(sz);
-		out.gradArr = std::make_shared<T[]>(sz);
-		for (int i = 0; i < sz; ++i) {
-			out.arr[i] = arr[i];
-			out.gradArr[i] = gradArr[i];
+		Tensor<T> out(contiguous());
+		if (out.storage == storage) {
+			out.storage = std::make_shared<Storage<T>>(sz);
+			out.offset = 0;
+			copy(*this, out);
+		}
+		if (requiresGrad()) {
+			out.autograd = std::make_shared<AutogradMeta<T>>();
+			if (autograd->grad) {
+				std::copy_n(autograd->grad.get(), sz, out.gradientBuffer());
+			}
+		}
+
+		return out;
+	}
+
+	/// true if the elements are laid out in row-major order
+	/// without gaps (after offset)
+	bool isContiguous() const noexcept
+	{
+		int expected = 1;
+		for (int i = dims.size() - 1; i >= 0; --i) {
+			if (dims.at(i) != 1 && strides.at(i) != expected) {
+				return false;
+			}
+			expected *= dims.at(i);
 		}
+		return true;
+	}
 
+	/// returns this Tensor if it already is contiguous or otherwise
+	/// a copy of it with row-major layout. The gradient
+	/// (always contiguous) and autograd graph are shared.
+	Tensor<T> contiguous() const
+	{
+		if (isContiguous()) {
+			return *this;
+		}
+		Tensor<T> out(*this);
+		out.storage = std::make_shared<Storage<T>>(sz);
+		out.offset = 0;
+		out.strides = contiguousStrides(dims);
+		copy(*this, out);
 		return out;
 	}
 
+	/// view of a 2d Tensor with both dimensions swapped
 	Tensor<T> transpose() const
 	{
 		// only works for 2d Tensors
 		if (dims.size() != 2) {
 			throw ShapeMismatchError{"can only transpose 2d Tensor but have shape " + dims.toString()};
 		}
-		Tensor<T> out((*this).clone());
-		out.dims = IntArrRef({dims.at(1), dims.at(0)});
-		for (int i = 0; i < dims.at(0); i++) {
-			for (int j = 0; j < dims.at(1); j++) {
-				T val = getSingle({i, j});
-				out.setSingle(val, {j, i});
-			}
+		return transpose(0, 1);
+	}
+
+	/// view with dimensions dim0 and dim1 swapped
+	Tensor<T> transpose(int dim0, int dim1) const
+	{
+		dim0 = (dim0 >= 0) ? dim0 : dim0 + dims.size();
+		dim1 = (dim1 >= 0) ? dim1 : dim1 + dims.size();
+		if (dim0 < 0 || dim0 >= dims.size() || dim1 < 0 || dim1 >= dims.size()) {
+			throw IndexError("can't transpose dimensions " + std::to_string(dim0) + " and "
+				+ std::to_string(dim1) + " of Tensor with shape " + dims.toString());
 		}
+		Tensor<T> out(detachedView());
+		out.dims = dims.clone();
+		out.strides = strides.clone();
+		std::swap(out.dims[dim0], out.dims[dim1]);
+		std::swap(out.strides[dim0], out.strides[dim1]);
 		return out;
 	}
 
 	/// returns new Tensor that however will point to same
-	/// array contents but with different dims property
+	/// array contents but with different dims property.
+	/// Non-contiguous Tensors are made contiguous first.
 	Tensor<T> reshape(IntArrRef newDims) const
 	{
-		Tensor<T> out(*this);
-		if (out.sz != sz) {
+		size_type newSz = 1;
+		for (int dim : newDims) {
+			newSz *= dim;
+		}
+		if (newSz != sz) {
 			throw ShapeMismatchError{"can't reshape from shape " + dims.toString() + " to " + newDims.toString()};
 		}
+		Tensor<T> out(contiguous());
 		out.dims = newDims.clone();
+		out.strides = contiguousStrides(newDims);
 		return out;
 	}
 
-	Tensor<T>& applyUnary(auto fn)
+	/// view of this Tensor broadcast to newDims without copying it.
+	/// Broadcast dimensions get stride 0 so the view should only be read.
+	Tensor<T> expand(const IntArrRef& newDims) const
 	{
-		for (int i = 0; i < sz; ++i) {
-			arr[i] = fn(arr[i]);
+		int rankDiff = newDims.size() - dims.size();
+		if (rankDiff < 0) {
+			throw ShapeMismatchError{"can't expand shape " + dims.toString() + " to " + newDims.toString()};
+		}
+		Tensor<T> out(detachedView());
+		out.dims = newDims.clone();
+		out.strides = IntArrRef(newDims.size(), 0);
+		out.sz = 1;
+		for (int i = 0; i < newDims.size(); ++i) {
+			out.sz *= newDims[i];
+			if (i < rankDiff) {
+				continue;
+			}
+			int dim = dims[i - rankDiff];
+			if (dim == newDims[i]) {
+				out.strides[i] = strides[i - rankDiff];
+			} else if (dim != 1) {
+				throw ShapeMismatchError{"can't expand shape " + dims.toString() + " to " + newDims.toString()};
+			}
 		}
+		return out;
+	}
+
+	Tensor<T>& applyUnary(auto fn)
+	{
+		T* vals = data();
+		LoopPlan<1> plan(dims, {strides});
+		plan.parallelForEachRow(defaultGrainSize, [vals, &fn](const std::array<std::ptrdiff_t, 1>& offsets, int n, const std::array<int, 1>& innerStrides) {
+			T* row = vals + offsets[0];
+			if (innerStrides[0] == 1) {
+				for (int j = 0; j < n; ++j) {
+					row[j] = fn(row[j]);
+				}
+			} else {
+				for (int j = 0; j < n; ++j) {
+					row[j * innerStrides[0]] = fn(row[j * innerStrides[0]]);
+				}
+			}
+		});
 		return *this;
 	}
 	
@@ -305,18 +647,20 @@ public:
 		return out.exp_();
 	}
 
-	T getSingle(IntArrRef idx) const
+	/// bounds checked element access
+	T getSingle(const IntArrRef& idx) const
 	{
-		return arr[getLinIdx(idx)];
+		return storage->data()[getLinIdx(idx)];
 	}
 
-	void setSingle(T val, IntArrRef idx)
+	/// bounds checked element access
+	void setSingle(T val, const IntArrRef& idx)
 	{
-		arr[getLinIdx(idx)] = val;
+		storage->data()[getLinIdx(idx)] = val;
 	}
 
-	/// does not call function on last step if it doesn't
-	/// fully fit into array
+	/// calls fn for every 1 element wide view along axis
+	/// together with the index of the last element in it
 	void iter(auto fn, int axis=-1) const
 	{
 		if (axis > dims.size() || axis > 1) {
@@ -325,23 +669,14 @@ public:
 		if (axis < 0) {
 			axis += dims.size();
 		}
-		IntArrRef step = IntArrRef(dims.size(), 0);// - IntArrRef(dims.size(), 1);
-		step[(axis+1)%2] = 1;
-		IntArrRef limit = dims.clone();
-		limit[(axis + 1) % 2] = 1;
-		Tensor<T> curIter(limit);
-		IntArrRef idx(step.size(), 0); // set it to all 0
-		IntArrRef offset(step.size(), 0);
-
-		while (idx.lessThan(dims, dims)) {
-			curIter.setSingle(getSingle(idx), idx - offset);
-			IntArrRef oldIdx = idx.clone();
-			if (idx.incr(offset, limit, std::nullopt) >= limit.size() - 1) {
-				fn(oldIdx, curIter);
-				idx = offset + step;
-				offset = offset + step;
-				limit = limit + step;
-			}
+		int iterAxis = (axis + 1) % 2;
+		std::vector<std::tuple<int,int,int>> ranges {{0, dims.at(0), 1}, {0, dims.at(1), 1}};
+		IntArrRef lastIdx(dims.size(), 0);
+		lastIdx[axis] = dims.at(axis) - 1;
+		for (int i = 0; i < dims.at(iterAxis); i++) {
+			ranges[iterAxis] = {i, i+1, 1};
+			lastIdx[iterAxis] = i;
+			fn(lastIdx.clone(), slice(ranges));
 		}
 	}
 
@@ -358,7 +693,7 @@ public:
 			for (int j = 0; j < prevDimsUpdated; j++) {
 				out += "[";
 			}
-			out += std::to_string(getSingle(idx));
+			out += std::to_string(storage->data()[kernelLinIdx(idx)]);
 			int dimsUpdated = idxIncr(idx);
 			for (int j = 0; j < dimsUpdated; j++) {
 				out += "]";
@@ -375,9 +710,16 @@ private:
 	/// RETURNS: the number of carries, i.e. how many dimensions
 	/// higher than the last one had to be incremented
 	int idxIncr(IntArrRef& idx) const
+	{
+		return idxIncr(idx, idx.size() - 1);
+	}
+
+	/// same as idxIncr(idx) but starts incrementing at dimension
+	/// lastDim, i.e. all higher dimensions are left untouched
+	int idxIncr(IntArrRef& idx, int lastDim) const
 	{
 		int i;
-		for (i = idx.size() - 1; i >= 0; i--) {
+		for (i = lastDim; i >= 0; i--) {
 			idx[i] += 1;
 			if (idx[i] >= dims.at(i)) {
 				idx[i] = 0;
@@ -385,111 +727,277 @@ private:
 				break;
 			}
 		}
-		return (idx.size() - 1) - i;
+		return lastDim - i;
 	}
 
-	/// Increment index while keeping it in the slice boundaries
-	/// specified by ranges.
-	/// Each tuple stands for start, end, step in the according dimension
-	int idxIncr(IntArrRef& idx, std::vector<std::tuple<int,int,int>> ranges) const
+	/// view sharing the contents but neither gradient nor
+	/// autograd graph with this Tensor
+	Tensor<T> detachedView() const
 	{
-		int i;
-		for (i = idx.size() - 1; i >= 0; i--) {
-			idx[i] += std::get<2>(ranges[i]);
-			if (idx[i] >= std::get<1>(ranges[i])) {
-				idx[i] = std::get<0>(ranges[i]);
+		Tensor<T> out(*this);
+		out.autograd.reset();
+		return out;
+	}
+
+	/// contiguous Tensor viewing elements of storage
+	Tensor(std::shared_ptr<Storage<T>> storage, const IntArrRef& dimensions, size_type size)
+	  : dims {dimensions},
+		strides {contiguousStrides(dimensions)},
+		storage (std::move(storage)),
+		offset (0),
+		sz (size)
+	{}
+
+	/// Tensor with the dims of this one viewing its gradient without copying it
+	Tensor<T> gradientView() const
+	{
+		return Tensor<T>(std::make_shared<Storage<T>>(autograd->grad, sz), dims, sz);
+	}
+
+	/// Nodes of the autograd graph below this Tensor that require a
+	/// gradient in topological order (inputs first, this Tensor last).
+	/// Uses an explicit stack of nodes and the index of the next input
+	/// to visit so deep graphs can't overflow the call stack.
+	std::vector<Tensor<T>> topologicalOrder() const
+	{
+		std::uint64_t epoch = AutogradMeta<T>::nextEpoch++;
+		std::vector<Tensor<T>> sorted;
+		std::vector<std::pair<const Tensor<T>*, size_t>> stack;
+		autograd->visitEpoch = epoch;
+		stack.emplace_back(this, 0);
+		while (!stack.empty()) {
+			auto& [node, nextChild] = stack.back();
+			if (node->autograd->graphFreed) {
+				throw std::logic_error("autograd graph has already been freed by a backward pass, "
+									   "call backward with retainGraph = true to run it again");
+			}
+			const std::vector<Tensor<T>>& children = node->autograd->gradGraphChildren;
+			if (nextChild < children.size()) {
+				const Tensor<T>& child = children[nextChild++];
+				// constants and data don't need to be visited
+				if (child.requiresGrad() && child.autograd->visitEpoch != epoch) {
+					child.autograd->visitEpoch = epoch;
+					stack.emplace_back(&child, 0);
+				}
 			} else {
-				break;
+				sorted.push_back(*node);
+				stack.pop_back();
 			}
 		}
-		return (idx.size() - 2) - i;
-	}
-
-	/// @brief compute the ranges for each array in every dimension
-	/// across which they can iterate
-	/// @tparam T element type of both array operands
-	/// @param src copying from this array
-	/// @param dst to this array
-	/// @param idcs the index selection in the bigger array so that
-	/// we copy from equally sized arrays
-	/// @return
-	/// - srcRanges: the ranges over which src must be iterated
-	/// - dstRanges: the ranges over which dst must be iterated
-	/// - outDims: the dimensions of the smaller of the arrays
-	/// - totalSize: the total number of elements that will be copied
-	static std::tuple<
-		std::vector<std::tuple<int,int,int>>,
-		std::vector<std::tuple<int,int,int>>,
-		std::vector<int>,
-		int
-	>
-	getCopyRanges(const Tensor<T>& src, const Tensor<T>& dst, std::initializer_list<IdxSel> idcs)
-	{
-		std::vector<int> outDims;
-		std::vector<std::tuple<int,int,int>> srcRanges;
-		std::vector<std::tuple<int,int,int>> dstRanges;
-
-		if (src.dims.size() != dst.dims.size()) {
-			throw ShapeMismatchError{
-				"shapes " + src.dims.toString() + " and " +
-				dst.dims.toString() + " are not compatible"};
-		}
-
-		const Tensor<T>& bigger = (src.sz >= dst.sz) ? src : dst;
-		const Tensor<T>& smaller = (src.sz >= dst.sz) ? dst : src;
-
-		for (int i = 0; i < bigger.dims.size(); i++) {
-			std::tuple<int,int,int> srcRange;
-			if (i < idcs.size()) {
-				IdxSel idxS = *(idcs.begin() + i);
-				if (std::holds_alternative<Slice>(idxS)) {
-					srcRange =
-						std::get<Slice>(idxS).toRangeTuple(bigger.dims.at(i));
-				} else {
-					int idx = std::get<int>(idxS);
-					srcRange = {idx, idx+1, 1};
-				}
+		return sorted;
+	}
+
+	/// backward passes with fewer gradient elements in nodes that
+	/// propagate them further run serially
+	static constexpr size_type parallelBackwardMinElements = 1 << 15;
+
+	static size_type backwardWork(const std::vector<Tensor<T>>& sorted)
+	{
+		size_type work = 0;
+		for (const Tensor<T>& node : sorted) {
+			if (node.autograd->backwardFn) {
+				work += node.sz;
+			}
+		}
+		return work;
+	}
+
+	/// propagate the gradient of node to its inputs
+	/// and free its part of the graph unless retainGraph is set
+	static void runBackwardFn(const Tensor<T>& node, bool retainGraph)
+	{
+		AutogradMeta<T>& meta = *node.autograd;
+		if (!meta.backwardFn) {
+			return;
+		}
+		// without a gradient the inputs wouldn't get anything either
+		if (meta.grad) {
+			if (autofn::Profiler::isEnabled()) [[unlikely]] {
+				autofn::ProfileRecord record(meta.opName, autofn::ProfilePhase::backward);
+				record.shapes = autofn::profileShapes(meta.gradGraphChildren, node.dims);
+				meta.backwardFn(node.gradientView(), meta.gradGraphChildren);
 			} else {
-				srcRange = {0, bigger.dims.at(i), 1};
+				meta.backwardFn(node.gradientView(), meta.gradGraphChildren);
+			}
+		}
+		if (!retainGraph) {
+			meta.backwardFn = nullptr;
+			meta.gradGraphChildren.clear();
+			meta.graphFreed = true;
+		}
+	}
+
+	/// Run the backward functions of the nodes in sorted (in topological
+	/// order, this Tensor last) on the global thread pool.
+	/// Every node counts the nodes using it as an input that haven't run
+	/// yet and becomes ready when that count drops to zero, so independent
+	/// branches of the graph are processed concurrently.
+	static void runBackwardParallel(std::vector<Tensor<T>>& sorted, bool retainGraph)
+	{
+		ThreadPool& pool = threadPool();
+		std::unordered_map<const AutogradMeta<T>*, size_t> indices;
+		indices.reserve(sorted.size());
+		for (size_t i = 0; i < sorted.size(); ++i) {
+			indices.emplace(sorted[i].autograd.get(), i);
+		}
+		std::unique_ptr<std::atomic<int>[]> pendingConsumers(new std::atomic<int>[sorted.size()]);
+		for (size_t i = 0; i < sorted.size(); ++i) {
+			pendingConsumers[i].store(0, std::memory_order_relaxed);
+		}
+		// inputs used several times by a node count once for every use
+		std::vector<std::vector<size_t>> inputIndices(sorted.size());
+		for (size_t i = 0; i < sorted.size(); ++i) {
+			for (const Tensor<T>& child : sorted[i].autograd->gradGraphChildren) {
+				if (child.requiresGrad()) {
+					size_t childIdx = indices.at(child.autograd.get());
+					inputIndices[i].push_back(childIdx);
+					pendingConsumers[childIdx].fetch_add(1, std::memory_order_relaxed);
+				}
 			}
-			int dimSize = Slice::calcDimSize(srcRange);
-			outDims.push_back(dimSize);
-			srcRanges.push_back(srcRange);
-			dstRanges.push_back({0, dimSize, 1});
 		}
 
-		return {
-			srcRanges,
-			dstRanges,
-			outDims,
-			(src.sz > dst.sz) ? dst.sz : src.sz
+		std::atomic<size_t> remaining = sorted.size();
+		std::atomic<bool> failed = false;
+		std::exception_ptr firstError;
+		std::mutex errorMutex;
+
+		std::function<void(size_t)> runFrom;
+		runFrom = [&](size_t idx) {
+			// continue with one ready input in this thread, hand the others
+			// to the pool and loop instead of recursing along chains
+			while (true) {
+				{
+					Tensor<T> node = std::move(sorted[idx]);
+					if (!failed) {
+						try {
+							autofn::NoGradGuard noGrad;
+							runBackwardFn(node, retainGraph);
+						} catch (...) {
+							std::lock_guard<std::mutex> lock(errorMutex);
+							if (!firstError) {
+								firstError = std::current_exception();
+							}
+							failed = true;
+						}
+					}
+				}
+
+				size_t next = sorted.size();
+				for (size_t childIdx : inputIndices[idx]) {
+					if (pendingConsumers[childIdx].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+						if (next == sorted.size()) {
+							next = childIdx;
+						} else {
+							pool.submit([&runFrom, childIdx]() {runFrom(childIdx);});
+						}
+					}
+				}
+				bool done = next == sorted.size();
+				// nothing captured by reference may be touched after the last
+				// decrement as the calling thread returns right away then
+				remaining.fetch_sub(1, std::memory_order_acq_rel);
+				if (done) {
+					return;
+				}
+				idx = next;
+			}
 		};
+
+		runFrom(sorted.size() - 1);
+		while (remaining.load(std::memory_order_acquire) > 0) {
+			if (!pool.runPendingTask()) {
+				std::this_thread::yield();
+			}
+		}
+		if (firstError) {
+			std::rethrow_exception(firstError);
+		}
 	}
 
+	/// gradient storage, allocated zero initialised on first use
+	T* gradientBuffer()
+	{
+		if (!autograd->grad) {
+			autograd->grad = makeAlignedBuffer<T>(sz);
+		}
+		return autograd->grad.get();
+	}
 
-	static void copy(const Tensor<T>& src, Tensor<T>& dst,
-		const std::vector<std::tuple<int,int,int>>& srcRanges,
-		const std::vector<std::tuple<int,int,int>>& dstRanges,
-		int totalSize)
+	/// view of the elements selected by ranges.
+	/// Each tuple stands for start, end, step in the according dimension
+	Tensor<T> slice(const std::vector<std::tuple<int,int,int>>& ranges) const
 	{
-		IntArrRef srcIdx (src.dims.size());
-		IntArrRef dstIdx (dst.dims.size());
-		for (int i = 0; i < srcRanges.size(); i++) {
-			srcIdx[i] = std::get<0>(srcRanges[i]);
-			dstIdx[i] = std::get<0>(dstRanges[i]);
+		IntArrRef outDims(dims.size());
+		IntArrRef outStrides(dims.size());
+		size_type outOffset = offset;
+		size_type outSz = 1;
+		for (int i = 0; i < dims.size(); i++) {
+			auto [start, end, step] = ranges[i];
+			if (step <= 0) {
+				throw std::invalid_argument("slice step needs to be positive");
+			}
+			int dimSize = std::max(Slice::calcDimSize(start, end, step), 0);
+			if (dimSize > 0 && (start < 0 || end > dims.at(i) || start >= dims.at(i))) {
+				throw IndexError("slice (" + std::to_string(start) + ","
+					+ std::to_string(end) + "," + std::to_string(step)
+					+ ") out of range in dimension " + std::to_string(i)
+					+ " of array with shape " + dims.toString());
+			}
+			outDims[i] = dimSize;
+			outStrides[i] = strides.at(i) * step;
+			if (dimSize > 0) {
+				// in ptrdiff_t, offsets of large Tensors don't fit into int
+				outOffset += static_cast<std::ptrdiff_t>(start) * strides.at(i);
+			}
+			outSz *= dimSize;
 		}
 
+		Tensor<T> out(*this);
+		out.dims = outDims;
+		out.strides = outStrides;
+		out.offset = outOffset;
+		out.sz = outSz;
+		return out.detachedView();
+	}
 
-		for (int i = 0; i < totalSize; i++) {
-			T val = src.getSingle(srcIdx);
-			dst.setSingle(val, dstIdx);
-			src.idxIncr(srcIdx, srcRanges);
-			dst.idxIncr(dstIdx, dstRanges);
+	/// copy all elements of src into the equally shaped dst
+	static void copy(const Tensor<T>& src, Tensor<T>& dst)
+	{
+		if (src.sz == 0) {
+			return;
 		}
+		const T* srcData = src.data();
+		T* dstData = dst.data();
+		LoopPlan<2> plan(src.dims, {dst.strides, src.strides});
+		plan.parallelForEachRow(defaultGrainSize, [dstData, srcData](const std::array<std::ptrdiff_t, 2>& offsets, int n, const std::array<int, 2>& innerStrides) {
+			T* dstRow = dstData + offsets[0];
+			const T* srcRow = srcData + offsets[1];
+			if (innerStrides[0] == 1 && innerStrides[1] == 1) {
+				std::copy_n(srcRow, n, dstRow);
+			} else {
+				for (int j = 0; j < n; ++j) {
+					dstRow[j * innerStrides[0]] = srcRow[j * innerStrides[1]];
+				}
+			}
+		});
 	}
 
 
-	int getLinIdx(IntArrRef idx) const
+	/// storage index for internal kernels that only ever produce
+	/// valid indices, see NUM_KERNEL_BOUNDS_CHECK
+	std::ptrdiff_t kernelLinIdx(const IntArrRef& idx) const
+	{
+		if constexpr (kernelBoundsCheck) {
+			return getLinIdx(idx);
+		}
+		std::ptrdiff_t linIdx = offset;
+		for (int i = 0; i < dims.size(); ++i) {
+			linIdx += static_cast<std::ptrdiff_t>(idx.at(i)) * strides.at(i);
+		}
+		return linIdx;
+	}
+
+	std::ptrdiff_t getLinIdx(const IntArrRef& idx) const
 	{
 		if (idx.size() != dims.size()) {
 			throw std::invalid_argument("index for getSingle needs to have"
@@ -497,22 +1005,18 @@ private:
 		}
 
 
-		int linIdx = 0;
+		std::ptrdiff_t linIdx = offset;
 		for (int i = idx.size()-1; i >= 0; --i) {
 			// negative indeces mean index from back of array
-			int idx_reformatted = (idx[i] >= 0) ? idx[i] : (dims.at(i) + idx[i]);
-			if (idx_reformatted >= dims.at(i)) {
+			int idx_reformatted = (idx.at(i) >= 0) ? idx.at(i) : (dims.at(i) + idx.at(i));
+			if (idx_reformatted < 0 || idx_reformatted >= dims.at(i)) {
 				throw IndexError(
 					"index out of range "
 					+ idx.toString() + " in dimension "
 					+ std::to_string(i) + " of array with shape "
 					+ dims.toString());
 			}
-			int add = idx[i];
-			for (int j = i + 1; j < dims.size(); j++) {
-				add *= dims.at(j);
-			}
-			linIdx += add;
+			linIdx += static_cast<std::ptrdiff_t>(idx_reformatted) * strides.at(i);
 		}
 		return linIdx;
 	}
@@ -520,57 +1024,6 @@ private:
 
 };
 
-template<typename T>
-Tensor<T> applyBinaryWithBroadcast(const Tensor<T>& a, const Tensor<T>& b, auto fn)
-{
-	bool swapped = (a.sz < b.sz || (a.sz == b.sz && b.dims.size() > a.dims.size()));
-	const Tensor<T>& bigger = (swapped) ? b : a;
-	const Tensor<T>& smaller = (swapped) ? a : b;
-	bool broadcastable = (bigger.sz % smaller.sz) == 0;
-	int numDimsDiff = (bigger.dims.size() - smaller.dims.size());
-
-	// how many times a dimension has to be repeated to broadcast it
-	// initialise with 0 for every dim
-	std::vector<int> dimReps(smaller.dims.size(), 0);
-	for (int bIdx = bigger.dims.size() - 1; bIdx >= 0; --bIdx) {
-		int sIdx = bIdx - numDimsDiff;
-		if (sIdx < 0) {
-			broadcastable = true;
-			dimReps[0] *= bigger.dims.at(bIdx);
-		} else {
-			if ((bigger.dims.at(bIdx) % smaller.dims.at(sIdx)) != 0) {
-				throw ShapeMismatchError{"can't broadcast shapes together: "
-					+ a.dims.toString() + " and " + b.dims.toString()};
-			}
-			dimReps[sIdx] = bigger.dims.at(bIdx) / smaller.dims.at(sIdx);
-		}
-	}
-
-	IntArrRef bIdx(bigger.dims.size());
-	IntArrRef sIdx(smaller.dims.size());
-
-	Tensor<T> out(bigger.clone());
-	std::vector<int> dimRepsLeft(dimReps);
-	for (int i = 0; i < bigger.sz; i++) {
-		T valA = bigger.getSingle(bIdx);
-		T valB = smaller.getSingle(sIdx);
-		out.setSingle((swapped) ? fn(valB, valA) : fn(valA, valB), bIdx);
-		bigger.idxIncr(bIdx);
-		int curSIdxDim = smaller.dims.size() - 1;
-
-		while (curSIdxDim >= 0 && ++(sIdx[curSIdxDim]) >= smaller.dims.at(curSIdxDim)) {
-			sIdx[curSIdxDim] = 0;
-			if (--(dimRepsLeft[curSIdxDim]) <= 0) {
-				dimRepsLeft[curSIdxDim] = dimReps[curSIdxDim];
-				curSIdxDim--;
-			} else {
-				break;
-			}
-		}
-	}
-	return out;
-}
-
 } // namespace num
 
 #endif
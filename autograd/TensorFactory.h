@@ -5,8 +5,10 @@
 #include <random>
 #include <chrono>
 #include <concepts>
+#include <type_traits>
 
 #include "IntArrRef.h"
+#include "BFloat16.h"
 #include "Tensor.h"
 
 namespace num {
@@ -17,9 +19,7 @@ class Tensor;
 template <num_t T>
 Tensor<T> zeros(const IntArrRef& dims)
 {
-	return Tensor<T>(dims, [](const IntArrRef& idx) -> T {
-		return 0;
-	});
+	return Tensor<T>(dims);
 }
 
 template <num_t T>
@@ -55,17 +55,25 @@ Tensor<T> fromDistribution(const IntArrRef& dims, num_t auto... distParams)
 	});
 }
 
+/// floating point type random numbers for T are drawn in: T itself for
+/// float and double (so float Tensors don't go through double), float
+/// for bfloat16 and double for integers
+template <num_t T>
+using randomReal_t = std::conditional_t<std::is_floating_point_v<acc_t<T>>, acc_t<T>, double>;
+
 template <num_t T>
 Tensor<T> randn(const IntArrRef& dims, T mean = 0, T stddev = 1)
 {
-	return fromDistribution<T, std::normal_distribution<>>(dims, mean, stddev);
+	using Real = randomReal_t<T>;
+	return fromDistribution<T, std::normal_distribution<Real>>(dims, static_cast<Real>(mean), static_cast<Real>(stddev));
 }
 
 template <num_t T>
 Tensor<T> randUniform(const IntArrRef& dims, T min, T max)
 {
-	if (std::is_floating_point<T>::value) {
-		return fromDistribution<T, std::uniform_real_distribution<>>(dims, min, max);
+	if constexpr (isFloatingPoint<T>) {
+		using Real = randomReal_t<T>;
+		return fromDistribution<T, std::uniform_real_distribution<Real>>(dims, static_cast<Real>(min), static_cast<Real>(max));
 	} else {
 		return fromDistribution<T, std::uniform_int_distribution<>>(dims, min, max);
 	}
@@ -0,0 +1,387 @@
+#ifndef TENSOR_IO_H
+#define TENSOR_IO_H
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define NUM_HAVE_MMAP 1
+#endif
+
+#include "Tensor.h"
+#include "NumErrors.h"
+
+namespace num {
+
+/// element types that can be stored in a Tensor file
+enum class DType : std::uint32_t {
+	float32 = 1,
+	float64 = 2,
+	int32 = 3,
+	int64 = 4,
+	bfloat16 = 5
+};
+
+template <typename T>
+constexpr DType dtypeOf()
+{
+	if constexpr (std::is_same_v<T, float>) {
+		return DType::float32;
+	} else if constexpr (std::is_same_v<T, double>) {
+		return DType::float64;
+	} else if constexpr (std::is_same_v<T, std::int32_t>) {
+		return DType::int32;
+	} else if constexpr (std::is_same_v<T, std::int64_t>) {
+		return DType::int64;
+	} else if constexpr (std::is_same_v<T, bfloat16>) {
+		return DType::bfloat16;
+	} else {
+		static_assert(!sizeof(T), "element type can't be stored in a Tensor file");
+	}
+}
+
+/// Layout of a Tensor file, all numbers little endian:
+///
+///     offset  size         field
+///     0       4            magic "NUMT"
+///     4       4            format version
+///     8       4            DType of the elements
+///     12      4            rank
+///     16      8            alignment of the data
+///     24      8            offset of the data (a multiple of the alignment)
+///     32      8            size of the data in bytes
+///     40      8 * rank     dims
+///     ...                  zero padding up to the data offset
+///     data offset          the elements in row-major order
+///
+/// The aligned data offset lets load() map the elements in place.
+struct TensorFileHeader {
+	static constexpr char magic[4] = {'N', 'U', 'M', 'T'};
+	static constexpr std::uint32_t currentVersion = 1;
+	static constexpr std::size_t fixedSize = 40;
+
+	std::uint32_t version = currentVersion;
+	DType dtype;
+	std::uint64_t alignment = bufferAlignment;
+	std::uint64_t dataOffset;
+	std::uint64_t dataBytes;
+	std::vector<std::int64_t> dims;
+
+	/// header bytes including the padding up to dataOffset
+	std::vector<char> encode() const
+	{
+		std::vector<char> out(dataOffset, 0);
+		char* pos = out.data();
+		auto put = [&pos](const auto& val) {
+			std::memcpy(pos, &val, sizeof(val));
+			pos += sizeof(val);
+		};
+		std::memcpy(pos, magic, sizeof(magic));
+		pos += sizeof(magic);
+		put(version);
+		put(static_cast<std::uint32_t>(dtype));
+		put(static_cast<std::uint32_t>(dims.size()));
+		put(alignment);
+		put(dataOffset);
+		put(dataBytes);
+		for (std::int64_t dim : dims) {
+			put(dim);
+		}
+		return out;
+	}
+
+	/// header of a file of fileSize bytes starting with bytes
+	/// (at least fixedSize and all dims), checked for consistency
+	static TensorFileHeader decode(const char* bytes, std::size_t available, std::uint64_t fileSize)
+	{
+		if (available < fixedSize || std::memcmp(bytes, magic, sizeof(magic)) != 0) {
+			throw FileFormatError("not a Tensor file");
+		}
+		TensorFileHeader header;
+		const char* pos = bytes + sizeof(magic);
+		auto get = [&pos](auto& val) {
+			std::memcpy(&val, pos, sizeof(val));
+			pos += sizeof(val);
+		};
+		std::uint32_t dtype;
+		std::uint32_t rank;
+		get(header.version);
+		get(dtype);
+		get(rank);
+		get(header.alignment);
+		get(header.dataOffset);
+		get(header.dataBytes);
+		header.dtype = static_cast<DType>(dtype);
+		if (header.version != currentVersion) {
+			throw FileFormatError("unsupported Tensor file version " + std::to_string(header.version));
+		}
+		if (rank == 0 || available < fixedSize + rank * sizeof(std::int64_t)) {
+			throw FileFormatError("truncated Tensor file header");
+		}
+		header.dims.resize(rank);
+		for (std::int64_t& dim : header.dims) {
+			get(dim);
+			if (dim < 0 || dim > std::numeric_limits<int>::max()) {
+				throw FileFormatError("invalid dimension " + std::to_string(dim) + " in Tensor file");
+			}
+		}
+		if (header.alignment == 0 || header.dataOffset % header.alignment != 0
+			|| header.dataOffset < static_cast<std::uint64_t>(pos - bytes)
+			// written without a sum that could wrap around
+			|| header.dataOffset > fileSize || header.dataBytes > fileSize - header.dataOffset) {
+			throw FileFormatError("inconsistent Tensor file header");
+		}
+		return header;
+	}
+
+	/// header for a Tensor with the given element type and dims
+	template <typename T>
+	static TensorFileHeader forTensor(const IntArrRef& dims, std::size_t size)
+	{
+		TensorFileHeader header;
+		header.dtype = dtypeOf<T>();
+		header.dims.assign(dims.begin(), dims.end());
+		std::size_t headerSize = fixedSize + dims.size() * sizeof(std::int64_t);
+		header.dataOffset = (headerSize + header.alignment - 1) / header.alignment * header.alignment;
+		header.dataBytes = size * sizeof(T);
+		return header;
+	}
+};
+
+namespace detail {
+
+inline void checkLittleEndian()
+{
+	if constexpr (std::endian::native != std::endian::little) {
+		throw std::runtime_error("Tensor files are only supported on little endian machines");
+	}
+}
+
+template <typename T>
+void checkHeaderFor(const TensorFileHeader& header, std::size_t size)
+{
+	if (header.dtype != dtypeOf<T>()) {
+		throw FileFormatError("Tensor file has element type " + std::to_string(static_cast<std::uint32_t>(header.dtype))
+			+ " but " + std::to_string(static_cast<std::uint32_t>(dtypeOf<T>())) + " was requested");
+	}
+	if (header.dataBytes % sizeof(T) != 0 || header.dataBytes / sizeof(T) != size) {
+		throw FileFormatError("size of the data doesn't match the dims in Tensor file");
+	}
+}
+
+inline IntArrRef headerDims(const TensorFileHeader& header)
+{
+	IntArrRef dims(header.dims.size());
+	for (size_t i = 0; i < header.dims.size(); ++i) {
+		dims[i] = static_cast<int>(header.dims[i]);
+	}
+	return dims;
+}
+
+/// number of elements of a Tensor of dims read from a file, which
+/// mustn't overflow
+inline std::size_t numElements(const IntArrRef& dims)
+{
+	if (std::ranges::find(dims, 0) != dims.end()) {
+		return 0;
+	}
+	std::size_t size = 1;
+	for (int dim : dims) {
+		if (size > std::numeric_limits<std::size_t>::max() / dim) {
+			throw FileFormatError("too many elements in Tensor file");
+		}
+		size *= dim;
+	}
+	return size;
+}
+
+inline std::size_t roundUpToAlignment(std::size_t bytes)
+{
+	return (bytes + bufferAlignment - 1) / bufferAlignment * bufferAlignment;
+}
+
+#ifdef NUM_HAVE_MMAP
+/// path mapped into memory and its size, see load()
+inline std::pair<std::shared_ptr<char>, std::size_t> mapFile(const std::string& path, bool writable)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::system_error(errno, std::generic_category(), "can't open " + path);
+	}
+	struct stat info;
+	if (::fstat(fd, &info) != 0) {
+		int error = errno;
+		::close(fd);
+		throw std::system_error(error, std::generic_category(), "can't stat " + path);
+	}
+	std::size_t fileSize = info.st_size;
+	void* base = MAP_FAILED;
+	if (fileSize > 0) {
+		base = ::mmap(nullptr, fileSize,
+			writable ? PROT_READ | PROT_WRITE : PROT_READ,
+			writable ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+	}
+	int error = errno;
+	// the mapping stays valid after closing the file
+	::close(fd);
+	if (fileSize == 0) {
+		throw FileFormatError(path + " is empty");
+	}
+	if (base == MAP_FAILED) {
+		throw std::system_error(error, std::generic_category(), "can't map " + path);
+	}
+	std::shared_ptr<char> mapping(static_cast<char*>(base), [fileSize](char* ptr) {
+		::munmap(ptr, fileSize);
+	});
+	return {std::move(mapping), fileSize};
+}
+#endif
+
+/// the whole file at path and its size, mapped into memory where possible
+/// and otherwise read into an aligned buffer with a single read
+inline std::pair<std::shared_ptr<char>, std::size_t> readFile(const std::string& path)
+{
+#ifdef NUM_HAVE_MMAP
+	return mapFile(path, false);
+#else
+	std::ifstream in(path, std::ios::binary | std::ios::ate);
+	if (!in) {
+		throw std::system_error(errno, std::generic_category(), "can't open " + path);
+	}
+	std::size_t fileSize = in.tellg();
+	in.seekg(0);
+	std::shared_ptr<char[]> buffer = makeAlignedBuffer<char>(fileSize);
+	in.read(buffer.get(), fileSize);
+	if (!in) {
+		throw std::system_error(errno, std::generic_category(), "can't read " + path);
+	}
+	return {std::shared_ptr<char>(buffer, buffer.get()), fileSize};
+#endif
+}
+
+/// bytes taken by a record of a Tensor (a header followed by the data as
+/// in a Tensor file) including the padding that aligns the next record
+template <typename T>
+std::size_t recordSize(const IntArrRef& dims, std::size_t size)
+{
+	TensorFileHeader header = TensorFileHeader::forTensor<T>(dims, size);
+	return roundUpToAlignment(header.dataOffset + header.dataBytes);
+}
+
+/// write the record of t to the aligned dst, returns the end of the record
+template <typename T>
+char* writeRecord(const Tensor<T>& t, char* dst)
+{
+	Tensor<T> contiguous = t.contiguous();
+	TensorFileHeader header = TensorFileHeader::forTensor<T>(t.dims, t.size());
+	std::vector<char> headerBytes = header.encode();
+	std::copy_n(headerBytes.data(), headerBytes.size(), dst);
+	std::copy_n(reinterpret_cast<const char*>(contiguous.data()), header.dataBytes, dst + header.dataOffset);
+	char* end = dst + recordSize<T>(t.dims, t.size());
+	std::fill(dst + header.dataOffset + header.dataBytes, end, 0);
+	return end;
+}
+
+/// Tensor viewing the record at offset of the aligned file buffer
+/// (sharing its ownership), offset is moved past the record
+template <typename T>
+Tensor<T> viewRecord(const std::shared_ptr<char>& file, std::size_t fileSize, std::size_t& offset)
+{
+	if (offset > fileSize) {
+		throw FileFormatError("truncated file");
+	}
+	TensorFileHeader header = TensorFileHeader::decode(file.get() + offset, fileSize - offset, fileSize - offset);
+	IntArrRef dims = headerDims(header);
+	checkHeaderFor<T>(header, numElements(dims));
+	std::shared_ptr<T[]> data(file, reinterpret_cast<T*>(file.get() + offset + header.dataOffset));
+	offset += roundUpToAlignment(header.dataOffset + header.dataBytes);
+	return Tensor<T>::fromBuffer(dims, std::move(data));
+}
+
+} // namespace detail
+
+/// write t to path in the Tensor file format (see TensorFileHeader)
+template <num_t T>
+void save(const std::string& path, const Tensor<T>& t)
+{
+	detail::checkLittleEndian();
+	Tensor<T> contiguous = t.contiguous();
+	std::vector<char> header = TensorFileHeader::forTensor<T>(t.dims, t.size()).encode();
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out) {
+		throw std::system_error(errno, std::generic_category(), "can't open " + path + " for writing");
+	}
+	out.write(header.data(), header.size());
+	out.write(reinterpret_cast<const char*>(contiguous.data()), t.size() * sizeof(T));
+	out.close();
+	if (!out) {
+		throw std::system_error(errno, std::generic_category(), "can't write " + path);
+	}
+}
+
+/// Tensor stored in path, which needs to have element type T.
+/// The file is mapped into memory and the Tensor views the mapping without
+/// copying: opening is instant however large the file is, pages are read
+/// when they are first touched and processes loading the same file share
+/// them through the page cache. The mapping is read-only, writing to the
+/// Tensor crashes. With writable set writes go to private copies of the
+/// touched pages and never reach the file.
+/// Where mmap isn't available the file is read into a new buffer instead.
+template <num_t T>
+Tensor<T> load(const std::string& path, bool writable = false)
+{
+	detail::checkLittleEndian();
+#ifdef NUM_HAVE_MMAP
+	auto [mapping, fileSize] = detail::mapFile(path, writable);
+	TensorFileHeader header = TensorFileHeader::decode(mapping.get(), fileSize, fileSize);
+	IntArrRef dims = detail::headerDims(header);
+	detail::checkHeaderFor<T>(header, detail::numElements(dims));
+	// shares ownership of the mapping
+	std::shared_ptr<T[]> data(mapping, reinterpret_cast<T*>(mapping.get() + header.dataOffset));
+	return Tensor<T>::fromBuffer(dims, std::move(data));
+#else
+	std::ifstream in(path, std::ios::binary | std::ios::ate);
+	if (!in) {
+		throw std::system_error(errno, std::generic_category(), "can't open " + path);
+	}
+	std::uint64_t fileSize = in.tellg();
+	in.seekg(0);
+	std::vector<char> headerBytes(std::min<std::uint64_t>(fileSize, TensorFileHeader::fixedSize));
+	in.read(headerBytes.data(), headerBytes.size());
+	if (headerBytes.size() == TensorFileHeader::fixedSize) {
+		std::uint32_t rank;
+		std::memcpy(&rank, headerBytes.data() + 12, sizeof(rank));
+		headerBytes.resize(std::min<std::uint64_t>(fileSize, TensorFileHeader::fixedSize + std::uint64_t(rank) * 8));
+		in.read(headerBytes.data() + TensorFileHeader::fixedSize, headerBytes.size() - TensorFileHeader::fixedSize);
+	}
+	TensorFileHeader header = TensorFileHeader::decode(headerBytes.data(), headerBytes.size(), fileSize);
+	IntArrRef dims = detail::headerDims(header);
+	detail::checkHeaderFor<T>(header, detail::numElements(dims));
+	Tensor<T> out(dims);
+	in.seekg(header.dataOffset);
+	in.read(reinterpret_cast<char*>(out.data()), header.dataBytes);
+	if (!in) {
+		throw FileFormatError("truncated Tensor file " + path);
+	}
+	return out;
+#endif
+}
+
+} // namespace num
+
+#endif
@@ -37,11 +37,15 @@ Tensor<T> operator/(const Tensor<T>& a, const Tensor<T>& b)
 	return autofn::Div<T>::apply({a, b});
 }
 
-/// compute dot product of Tensors a and b
+/// compute dot product of Tensors a and b,
+/// batched over leading dimensions if they have more than 2
 template <num_t T>
 Tensor<T> matmul(const Tensor<T>& a, const Tensor<T>& b)
 {
-	return autofn::MatMul<T>::apply({a, b});
+	if (a.dims.size() == 2 && b.dims.size() == 2) {
+		return autofn::MatMul<T>::apply({a, b});
+	}
+	return autofn::BatchMatMul<T>::apply({a, b});
 }
 } // namespace num
 
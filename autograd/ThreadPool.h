@@ -0,0 +1,147 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace num {
+
+/// Work-stealing thread pool.
+/// Every worker has its own queue: tasks submitted from a worker go to the
+/// back of its queue and are taken from there again (depth first), idle
+/// workers steal from the front of the other queues. Threads waiting for
+/// tasks they submitted should help with runPendingTask() instead of
+/// blocking so that waiting from within a task can't deadlock the pool.
+class ThreadPool {
+public:
+	explicit ThreadPool(int numWorkers)
+	{
+		for (int i = 0; i < numWorkers; ++i) {
+			queues.push_back(std::make_unique<TaskQueue>());
+		}
+		for (int i = 0; i < numWorkers; ++i) {
+			workers.emplace_back([this, i]() {workerLoop(i);});
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stopping = true;
+		}
+		wakeUp.notify_all();
+		// workers finish the remaining tasks and are joined by the jthreads
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/// number of worker threads
+	int size() const noexcept
+	{
+		return workers.size();
+	}
+
+	/// queue task to be run by any worker (or a helping thread).
+	/// Runs it right away if the pool has no workers.
+	void submit(std::function<void()> task)
+	{
+		if (queues.empty()) {
+			task();
+			return;
+		}
+		int idx = (currentPool == this) ? currentWorker
+			: nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+		{
+			std::lock_guard<std::mutex> lock(queues[idx]->mutex);
+			queues[idx]->tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			++numPending;
+		}
+		wakeUp.notify_one();
+	}
+
+	/// run one queued task in the calling thread if there is any
+	bool runPendingTask()
+	{
+		std::function<void()> task;
+		if (!popTask((currentPool == this) ? currentWorker : 0, task)) {
+			return false;
+		}
+		task();
+		return true;
+	}
+private:
+	struct TaskQueue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<TaskQueue>> queues;
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;
+	std::atomic<size_t> numPending {0};
+	std::atomic<size_t> nextQueue {0};
+	bool stopping = false;
+	// declared last so that they are joined before the queues are destroyed
+	std::vector<std::jthread> workers;
+
+	static inline thread_local ThreadPool* currentPool = nullptr;
+	static inline thread_local int currentWorker = 0;
+
+	/// newest task of queue own or otherwise the oldest task of another queue
+	bool popTask(int own, std::function<void()>& task)
+	{
+		if (numPending.load(std::memory_order_acquire) == 0) {
+			return false;
+		}
+		for (size_t k = 0; k < queues.size(); ++k) {
+			TaskQueue& queue = *queues[(own + k) % queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (!queue.tasks.empty()) {
+				if (k == 0) {
+					task = std::move(queue.tasks.back());
+					queue.tasks.pop_back();
+				} else {
+					task = std::move(queue.tasks.front());
+					queue.tasks.pop_front();
+				}
+				--numPending;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void workerLoop(int idx)
+	{
+		currentPool = this;
+		currentWorker = idx;
+		std::function<void()> task;
+		while (true) {
+			if (popTask(idx, task)) {
+				task();
+				task = nullptr;
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			wakeUp.wait(lock, [this]() {return stopping || numPending > 0;});
+			if (stopping && numPending == 0) {
+				return;
+			}
+		}
+	}
+};
+
+} // namespace num
+
+#endif
@@ -0,0 +1,296 @@
+#ifndef TRAINING_STATE_H
+#define TRAINING_STATE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Tensor.h"
+#include "TensorIO.h"
+#include "Module.h"
+#include "Optim.h"
+#include "NumErrors.h"
+
+namespace nn {
+
+/// Layout of a training state file, all numbers little endian:
+///
+///     offset  size          field
+///     0       4             magic "NUMS"
+///     4       4             format version
+///     8       4             number of parameters
+///     12      4             number of optimizer state Tensors
+///     16      4             number of optimizer counters
+///     20      4             zero
+///     24      8 * counters  optimizer counters
+///     ...                   zero padding up to a multiple of 64
+///
+/// followed by a record for every parameter and then for every optimizer
+/// state Tensor. A record is laid out like a Tensor file (see
+/// num::TensorFileHeader) with offsets relative to its start and padded to
+/// a multiple of 64 bytes, so that the data of all records stays aligned.
+struct TrainingStateHeader {
+	static constexpr char magic[4] = {'N', 'U', 'M', 'S'};
+	static constexpr std::uint32_t currentVersion = 1;
+	static constexpr std::size_t fixedSize = 24;
+
+	std::uint32_t numParameters;
+	std::uint32_t numStateTensors;
+	std::vector<std::int64_t> counters;
+
+	/// bytes of the header including the padding
+	std::size_t size() const
+	{
+		return num::detail::roundUpToAlignment(fixedSize + counters.size() * sizeof(std::int64_t));
+	}
+
+	/// write the header to dst, which has room for size() bytes
+	void encode(char* dst) const
+	{
+		std::fill_n(dst, size(), 0);
+		std::uint32_t fields[] = {currentVersion, numParameters, numStateTensors,
+			static_cast<std::uint32_t>(counters.size())};
+		std::memcpy(dst, magic, sizeof(magic));
+		std::memcpy(dst + sizeof(magic), fields, sizeof(fields));
+		// data() of an empty vector may be null, which memcpy mustn't get
+		if (!counters.empty()) {
+			std::memcpy(dst + fixedSize, counters.data(), counters.size() * sizeof(std::int64_t));
+		}
+	}
+
+	static TrainingStateHeader decode(const char* bytes, std::size_t fileSize)
+	{
+		if (fileSize < fixedSize || std::memcmp(bytes, magic, sizeof(magic)) != 0) {
+			throw num::FileFormatError("not a training state file");
+		}
+		std::uint32_t fields[4];
+		std::memcpy(fields, bytes + sizeof(magic), sizeof(fields));
+		if (fields[0] != currentVersion) {
+			throw num::FileFormatError("unsupported training state file version " + std::to_string(fields[0]));
+		}
+		// checked before allocating the counters, the count comes from the file
+		if ((fileSize - fixedSize) / sizeof(std::int64_t) < fields[3]) {
+			throw num::FileFormatError("truncated training state file header");
+		}
+		TrainingStateHeader header {fields[1], fields[2], std::vector<std::int64_t>(fields[3])};
+		if (fileSize < header.size()) {
+			throw num::FileFormatError("truncated training state file header");
+		}
+		if (!header.counters.empty()) {
+			std::memcpy(header.counters.data(), bytes + fixedSize, header.counters.size() * sizeof(std::int64_t));
+		}
+		return header;
+	}
+};
+
+namespace detail {
+
+/// a training state file in memory, ready to be written at once
+class TrainingStateSnapshot {
+public:
+	template <num::num_t T, num::num_t S>
+	TrainingStateSnapshot(const std::vector<num::Tensor<T>>& parameters, const optim::OptimizerState<S>& state)
+	{
+		num::detail::checkLittleEndian();
+		TrainingStateHeader header {static_cast<std::uint32_t>(parameters.size()),
+			static_cast<std::uint32_t>(state.tensors.size()), state.counters};
+		size = header.size();
+		for (const num::Tensor<T>& t : parameters) {
+			size += num::detail::recordSize<T>(t.dims, t.size());
+		}
+		for (const num::Tensor<S>& t : state.tensors) {
+			size += num::detail::recordSize<S>(t.dims, t.size());
+		}
+		// every byte is written below
+		bytes = std::make_unique_for_overwrite<char[]>(size);
+		header.encode(bytes.get());
+		char* pos = bytes.get() + header.size();
+		for (const num::Tensor<T>& t : parameters) {
+			pos = num::detail::writeRecord(t, pos);
+		}
+		for (const num::Tensor<S>& t : state.tensors) {
+			pos = num::detail::writeRecord(t, pos);
+		}
+	}
+
+	/// Write everything to path with a single write. The bytes go to a
+	/// temporary file next to path that replaces it once complete, so a
+	/// crash while writing leaves the previous file intact.
+	void write(const std::string& path) const
+	{
+		std::string tmpPath = path + ".tmp";
+		{
+			std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+			if (!out) {
+				throw std::system_error(errno, std::generic_category(), "can't open " + tmpPath + " for writing");
+			}
+			out.write(bytes.get(), size);
+			out.close();
+			if (!out) {
+				throw std::system_error(errno, std::generic_category(), "can't write " + tmpPath);
+			}
+		}
+		std::filesystem::rename(tmpPath, path);
+	}
+private:
+	std::unique_ptr<char[]> bytes;
+	std::size_t size;
+};
+
+/// copy the contents of src into the parameters of a module
+template <num::num_t T>
+void loadParameters(const std::vector<num::Tensor<T>>& src, const std::vector<num::Tensor<T>>& parameters)
+{
+	if (src.size() != parameters.size()) {
+		throw num::FileFormatError("training state has " + std::to_string(src.size())
+			+ " parameters but the module has " + std::to_string(parameters.size()));
+	}
+	for (size_t i = 0; i < src.size(); ++i) {
+		if (src[i].dims != parameters[i].dims) {
+			throw num::ShapeMismatchError("can't load parameter of shape " + src[i].dims.toString()
+				+ " into parameter of shape " + parameters[i].dims.toString());
+		}
+		// parameters own contiguous storage, also when flattened
+		std::copy_n(src[i].data(), src[i].size(), parameters[i].data());
+	}
+}
+
+/// parameters and optimizer state (kept in acc_t<T>, see optim::OptimBase)
+/// stored in path, viewing the file
+template <num::num_t T, num::num_t S = num::acc_t<T>>
+std::pair<std::vector<num::Tensor<T>>, optim::OptimizerState<S>> readTrainingState(const std::string& path)
+{
+	num::detail::checkLittleEndian();
+	auto [file, fileSize] = num::detail::readFile(path);
+	TrainingStateHeader header = TrainingStateHeader::decode(file.get(), fileSize);
+	std::size_t offset = header.size();
+	std::vector<num::Tensor<T>> parameters;
+	for (std::uint32_t i = 0; i < header.numParameters; ++i) {
+		parameters.push_back(num::detail::viewRecord<T>(file, fileSize, offset));
+	}
+	optim::OptimizerState<S> state {{}, std::move(header.counters)};
+	for (std::uint32_t i = 0; i < header.numStateTensors; ++i) {
+		state.tensors.push_back(num::detail::viewRecord<S>(file, fileSize, offset));
+	}
+	return {std::move(parameters), std::move(state)};
+}
+
+} // namespace detail
+
+/// Save the parameters of module and the state of optimizer to path so
+/// that training can be resumed with loadTrainingState(). Everything is
+/// packed into one buffer first and written with a single write.
+template <num::num_t T, typename Derived, typename Optimizer>
+void saveTrainingState(const std::string& path, const Module<T, Derived>& module, const Optimizer& optimizer)
+{
+	detail::TrainingStateSnapshot(module.parameters, optimizer.state()).write(path);
+}
+
+/// save only the parameters of module
+template <num::num_t T, typename Derived>
+void saveTrainingState(const std::string& path, const Module<T, Derived>& module)
+{
+	detail::TrainingStateSnapshot(module.parameters, optim::OptimizerState<T>{}).write(path);
+}
+
+/// Restore the parameters of module and the state of optimizer saved to
+/// path by saveTrainingState(). Module and optimizer need to be set up
+/// like the saved ones, i.e. with parameters of the same shapes. The file
+/// is mapped into memory and every Tensor is copied with one memcpy.
+template <num::num_t T, typename Derived, typename Optimizer>
+void loadTrainingState(const std::string& path, Module<T, Derived>& module, Optimizer& optimizer)
+{
+	auto [parameters, state] = detail::readTrainingState<T>(path);
+	detail::loadParameters(parameters, module.parameters);
+	optimizer.loadState(state);
+}
+
+/// restore only the parameters of module (e.g. for inference), the
+/// optimizer state stored in path is ignored
+template <num::num_t T, typename Derived>
+void loadTrainingState(const std::string& path, Module<T, Derived>& module)
+{
+	auto [parameters, state] = detail::readTrainingState<T>(path);
+	detail::loadParameters(parameters, module.parameters);
+}
+
+/// Saves training states on a background thread so that the training loop
+/// isn't blocked by the disk. save() takes a snapshot right away, so
+/// training can continue and change the parameters while it is written.
+/// Only one save is in flight at a time: a new save() first waits for the
+/// previous one.
+///
+///     nn::TrainingStateWriter writer;
+///     for (int epoch = 0; epoch < epochs; ++epoch) {
+///         train(model, opt);
+///         writer.save("checkpoint.bin", model, opt);
+///     }
+///     writer.wait();
+class TrainingStateWriter {
+public:
+	TrainingStateWriter() = default;
+
+	TrainingStateWriter(const TrainingStateWriter&) = delete;
+	TrainingStateWriter& operator=(const TrainingStateWriter&) = delete;
+
+	/// waits for the last save, errors of it are dropped
+	~TrainingStateWriter()
+	{
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	template <num::num_t T, typename Derived, typename Optimizer>
+	void save(const std::string& path, const Module<T, Derived>& module, const Optimizer& optimizer)
+	{
+		wait();
+		start(path, detail::TrainingStateSnapshot(module.parameters, optimizer.state()));
+	}
+
+	template <num::num_t T, typename Derived>
+	void save(const std::string& path, const Module<T, Derived>& module)
+	{
+		wait();
+		start(path, detail::TrainingStateSnapshot(module.parameters, optim::OptimizerState<T>{}));
+	}
+
+	/// wait until the last save is on disk, rethrows its error if it failed
+	void wait()
+	{
+		if (thread.joinable()) {
+			thread.join();
+		}
+		if (error) {
+			std::rethrow_exception(std::exchange(error, nullptr));
+		}
+	}
+private:
+	std::thread thread;
+	std::exception_ptr error;
+
+	void start(const std::string& path, detail::TrainingStateSnapshot snapshot)
+	{
+		thread = std::thread([this, path, snapshot = std::move(snapshot)]() {
+			try {
+				snapshot.write(path);
+			} catch (...) {
+				error = std::current_exception();
+			}
+		});
+	}
+};
+
+} // namespace nn
+
+#endif
@@ -2,14 +2,32 @@
 #define AUTOGRAD_H
 
 #include "Tensor.h"
+#include "BFloat16.h"
+#include "GradMode.h"
+#include "Storage.h"
+#include "Allocator.h"
 #include "IntArrRef.h"
 #include "TensorFactory.h"
 #include "NumErrors.h"
 #include "TensorOps.h"
+#include "Broadcast.h"
+#include "Reduce.h"
+#include "LoopPlan.h"
+#include "Gemm.h"
+#include "Parallel.h"
+#include "ThreadPool.h"
 #include "Slice.h"
 #include "Optim.h"
 #include "Losses.h"
 #include "Module.h"
+#include "DataLoader.h"
+#include "TensorIO.h"
+#include "TrainingState.h"
+#include "Checkpoint.h"
+#include "Function.h"
+#include "Expr.h"
+#include "StaticGraph.h"
 #include "AutogradFunction.h"
+#include "Profiler.h"
 
 #endif
\ No newline at end of file
@@ -0,0 +1,199 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bench {
+
+/// keep the compiler from optimizing away the computation of val
+template <typename T>
+inline void doNotOptimize(const T& val)
+{
+	asm volatile("" : : "r,m"(val) : "memory");
+}
+
+struct Options {
+	/// untimed runs before the measurement
+	int warmup = 2;
+	/// every benchmark runs at least minRepetitions times
+	/// and until minSeconds of measured time have passed
+	int minRepetitions = 5;
+	int maxRepetitions = 1000;
+	double minSeconds = 0.5;
+	/// only benchmarks whose name contains filter are run
+	std::string filter;
+};
+
+/// work done by one repetition, used for the throughput
+struct Work {
+	double items = 0;
+	double bytes = 0;
+};
+
+struct Result {
+	std::string name;
+	int repetitions = 0;
+	double medianNs = 0;
+	double p95Ns = 0;
+	double minNs = 0;
+	double meanNs = 0;
+	double itemsPerSecond = 0;
+	double bytesPerSecond = 0;
+};
+
+/// Runs benchmarks and collects their timings. A benchmark is timed
+/// repeatedly after some warmup runs and reports the median and 95th
+/// percentile of the repetitions as well as items and bytes per second
+/// derived from the median.
+class Suite {
+public:
+	Suite(const Options& options = {})
+	  : options (options)
+	{}
+
+	/// time fn()
+	template <typename Fn>
+	void run(const std::string& name, Work work, Fn fn)
+	{
+		run(name, work, []() {return 0;}, [&fn](int) {fn();});
+	}
+
+	/// time fn(setup()), only fn is measured. setup prepares
+	/// the input of every repetition, e.g. a fresh autograd graph.
+	template <typename Setup, typename Fn>
+	void run(const std::string& name, Work work, Setup setup, Fn fn)
+	{
+		if (name.find(options.filter) == std::string::npos) {
+			return;
+		}
+		std::cerr << std::left << std::setw(48) << name << std::flush;
+		for (int i = 0; i < options.warmup; ++i) {
+			auto input = setup();
+			fn(input);
+		}
+		std::vector<double> times;
+		double total = 0;
+		while (static_cast<int>(times.size()) < options.maxRepetitions
+			&& (static_cast<int>(times.size()) < options.minRepetitions || total < options.minSeconds * 1e9)) {
+			auto input = setup();
+			auto start = std::chrono::steady_clock::now();
+			fn(input);
+			auto stop = std::chrono::steady_clock::now();
+			double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+			times.push_back(ns);
+			total += ns;
+		}
+		std::ranges::sort(times);
+		Result result {
+			.name = name,
+			.repetitions = static_cast<int>(times.size()),
+			.medianNs = percentile(times, 0.5),
+			.p95Ns = percentile(times, 0.95),
+			.minNs = times.front(),
+			.meanNs = total / times.size()
+		};
+		result.itemsPerSecond = work.items * 1e9 / result.medianNs;
+		result.bytesPerSecond = work.bytes * 1e9 / result.medianNs;
+		std::cerr << formatTime(result.medianNs) << " median  "
+			<< formatTime(result.p95Ns) << " p95" << std::endl;
+		results.push_back(std::move(result));
+	}
+
+	const std::vector<Result>& getResults() const noexcept
+	{
+		return results;
+	}
+
+	/// write all results as JSON, context holds
+	/// extra information about the run (e.g. the commit)
+	void writeJson(std::ostream& out, const std::vector<std::pair<std::string, std::string>>& context = {}) const
+	{
+		out << "{\n  \"context\": {";
+		std::time_t now = std::time(nullptr);
+		char date[32];
+		std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+		out << "\n    \"date\": " << quote(date);
+		for (const auto& [key, val] : context) {
+			out << ",\n    " << quote(key) << ": " << quote(val);
+		}
+		out << "\n  },\n  \"benchmarks\": [";
+		for (size_t i = 0; i < results.size(); ++i) {
+			const Result& r = results[i];
+			out << (i > 0 ? "," : "") << "\n    {"
+				<< "\"name\": " << quote(r.name)
+				<< ", \"repetitions\": " << r.repetitions
+				<< ", \"median_ns\": " << number(r.medianNs)
+				<< ", \"p95_ns\": " << number(r.p95Ns)
+				<< ", \"min_ns\": " << number(r.minNs)
+				<< ", \"mean_ns\": " << number(r.meanNs)
+				<< ", \"items_per_second\": " << number(r.itemsPerSecond)
+				<< ", \"bytes_per_second\": " << number(r.bytesPerSecond)
+				<< "}";
+		}
+		out << "\n  ]\n}\n";
+	}
+private:
+	Options options;
+	std::vector<Result> results;
+
+	/// nearest rank percentile of the sorted times
+	static double percentile(const std::vector<double>& sorted, double p)
+	{
+		size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+		return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+	}
+
+	static std::string formatTime(double ns)
+	{
+		std::ostringstream out;
+		out << std::fixed << std::setprecision(2) << std::right << std::setw(9);
+		if (ns >= 1e9) {
+			out << ns / 1e9 << " s ";
+		} else if (ns >= 1e6) {
+			out << ns / 1e6 << " ms";
+		} else if (ns >= 1e3) {
+			out << ns / 1e3 << " us";
+		} else {
+			out << ns << " ns";
+		}
+		return out.str();
+	}
+
+	static std::string number(double val)
+	{
+		std::ostringstream out;
+		out << std::setprecision(6) << val;
+		return out.str();
+	}
+
+	static std::string quote(const std::string& str)
+	{
+		std::string out = "\"";
+		for (char c : str) {
+			if (c == '"' || c == '\\') {
+				out += '\\';
+			}
+			if (static_cast<unsigned char>(c) < 0x20) {
+				out += ' ';
+			} else {
+				out += c;
+			}
+		}
+		return out + "\"";
+	}
+};
+
+} // namespace bench
+
+#endif
@@ -0,0 +1,257 @@
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "autograd/autograd.h"
+#include "Harness.h"
+
+// Usage: bench [--filter substring] [--min-time seconds] [--threads n] [--out file.json]
+// Progress goes to stderr and the JSON results to stdout (or --out),
+// so that runs on different commits can be compared.
+
+#ifndef BENCH_GIT_COMMIT
+#define BENCH_GIT_COMMIT "unknown"
+#endif
+
+namespace {
+
+/// the model of model_demo
+template <num::num_t T>
+class RegressionModel : public nn::Module<T, RegressionModel<T>> {
+public:
+	RegressionModel()
+	: linLayer1 (this->registerModule(nn::Linear<T>(2, 10, true, autofn::Activation::relu))),
+	  linLayer2 (this->registerModule(nn::Linear<T>(10, 1, false)))
+	{}
+
+	num::Tensor<T> forward(const num::Tensor<T>& x) const
+	{
+		num::Tensor<T> out = linLayer1.forward(x);
+		return linLayer2.forward(out);
+	}
+private:
+	nn::Linear<T> linLayer1;
+	nn::Linear<T> linLayer2;
+};
+
+std::string shapeName(const num::IntArrRef& dims)
+{
+	std::string out;
+	for (size_t i = 0; i < dims.size(); ++i) {
+		out += (i > 0 ? "x" : "") + std::to_string(dims[i]);
+	}
+	return out;
+}
+
+void benchConstruction(bench::Suite& suite)
+{
+	for (int n : {16, 1 << 10, 1 << 16, 1 << 20}) {
+		double bytes = double(n) * sizeof(double);
+		suite.run("tensor/construct/" + std::to_string(n), {double(n), bytes}, [n]() {
+			num::Tensor<double> t(num::IntArrRef{n});
+			bench::doNotOptimize(t.data());
+		});
+	}
+	suite.run("tensor/construct/scalar", {1, sizeof(double)}, []() {
+		num::Tensor<double> t(1.0);
+		bench::doNotOptimize(t.data());
+	});
+}
+
+void benchBroadcast(bench::Suite& suite)
+{
+	struct Shapes {
+		num::IntArrRef a;
+		num::IntArrRef b;
+	};
+	std::vector<Shapes> shapes = {
+		{{1024, 1024}, {1024, 1024}},
+		{{1024, 1024}, {1024}},
+		{{1024, 1024}, {1024, 1}},
+		{{1024, 1024}, {1}},
+		{{1024, 1}, {1, 1024}},
+		{{64, 128, 128}, {128, 1}},
+		{{32}, {32}}
+	};
+	for (const Shapes& s : shapes) {
+		num::Tensor<double> a = num::randUniform<double>(s.a, -1, 1);
+		num::Tensor<double> b = num::randUniform<double>(s.b, -1, 1);
+		double items = 1;
+		for (int dim : num::broadcastShape(s.a, s.b)) {
+			items *= dim;
+		}
+		double bytes = (items + a.size() + b.size()) * sizeof(double);
+		suite.run("broadcast/add/" + shapeName(s.a) + "+" + shapeName(s.b), {items, bytes}, [&a, &b]() {
+			num::Tensor<double> out = num::applyBinaryWithBroadcast(a, b, std::plus<double>{});
+			bench::doNotOptimize(out.data());
+		});
+	}
+}
+
+void benchMatMul(bench::Suite& suite)
+{
+	struct Sizes {
+		int m;
+		int k;
+		int n;
+	};
+	for (Sizes s : std::vector<Sizes>{{16, 16, 16}, {64, 64, 64}, {256, 256, 256},
+			{512, 512, 512}, {4096, 64, 64}, {50, 2, 10}}) {
+		num::Tensor<double> a = num::randUniform<double>({s.m, s.k}, -1, 1);
+		num::Tensor<double> b = num::randUniform<double>({s.k, s.n}, -1, 1);
+		// items are floating point operations
+		double flops = 2.0 * s.m * s.k * s.n;
+		double bytes = double(s.m * s.k + s.k * s.n + s.m * s.n) * sizeof(double);
+		std::string name = std::to_string(s.m) + "x" + std::to_string(s.k) + "x" + std::to_string(s.n);
+		suite.run("matmul/forward/" + name, {flops, bytes}, [&a, &b]() {
+			autofn::NoGradGuard noGrad;
+			num::Tensor<double> out = autofn::mm<double>(a, b);
+			bench::doNotOptimize(out.data());
+		});
+	}
+}
+
+void benchBackward(bench::Suite& suite)
+{
+	// a long chain of element-wise ops on a small Tensor,
+	// dominated by the per node overhead of the graph traversal
+	for (int depth : {100, 1000}) {
+		num::Tensor<double> x = num::randUniform<double>({64}, -1, 1);
+		x.setRequiresGrad();
+		num::Tensor<double> w = num::randUniform<double>({64}, 0.9, 1.1);
+		suite.run("backward/deep/" + std::to_string(depth), {double(2 * depth), 0},
+			[&x, &w, depth]() {
+				x.zeroGradient();
+				num::Tensor<double> y = x;
+				for (int i = 0; i < depth; ++i) {
+					y = y * w + x;
+				}
+				return autofn::sum<double>(y);
+			},
+			[](num::Tensor<double>& loss) {loss.backward();});
+	}
+	// many independent branches of one leaf, the gradients
+	// of the branches accumulate into the same Tensor
+	for (int width : {100, 1000}) {
+		num::Tensor<double> x = num::randUniform<double>({256, 64}, -1, 1);
+		x.setRequiresGrad();
+		suite.run("backward/wide/" + std::to_string(width), {double(2 * width), 0},
+			[&x, width]() {
+				x.zeroGradient();
+				std::vector<num::Tensor<double>> branches;
+				for (int i = 0; i < width; ++i) {
+					branches.push_back(autofn::sum<double>(x * num::Tensor<double>(i)));
+				}
+				num::Tensor<double> y = branches[0];
+				for (int i = 1; i < width; ++i) {
+					y = y + branches[i];
+				}
+				return y;
+			},
+			[](num::Tensor<double>& loss) {loss.backward();});
+	}
+}
+
+void benchAdam(bench::Suite& suite)
+{
+	struct Config {
+		int numParams;
+		int paramSize;
+	};
+	for (Config c : std::vector<Config>{{1, 1 << 20}, {100, 10000}, {1000, 10}}) {
+		std::vector<num::Tensor<double>> params;
+		for (int i = 0; i < c.numParams; ++i) {
+			num::Tensor<double> p = num::randUniform<double>({c.paramSize}, -1, 1);
+			p.setRequiresGrad();
+			autofn::sum<double>(p).backward();
+			params.push_back(p);
+		}
+		optim::Adam<double> opt(params, 1e-3);
+		double items = double(c.numParams) * c.paramSize;
+		// parameter, gradient and both moments are read, all but the gradient written
+		double bytes = items * 7 * sizeof(double);
+		suite.run("adam/step/" + std::to_string(c.numParams) + "x" + std::to_string(c.paramSize),
+			{items, bytes}, [&opt]() {opt.step();});
+	}
+}
+
+void benchTraining(bench::Suite& suite)
+{
+	for (int batchSize : {50, 500}) {
+		RegressionModel<double> model;
+		model.flattenParameters();
+		optim::Adam<double> opt({model.flatParameter()}, 0.01);
+		int numSamples = 10000;
+		num::Tensor<double> inputs = num::randUniform<double>({numSamples, 2}, -5, 5);
+		num::Tensor<double> targets = autofn::pow<double>(inputs.get({num::Slice{}, 0}), 2) +
+				autofn::pow<double>(inputs.get({num::Slice{}, 1}), 2);
+		data::DataLoader<double> loader({inputs, targets}, {.batchSize = batchSize, .seed = 0});
+		// items are samples trained on per second
+		suite.run("train/regression/batch" + std::to_string(batchSize), {double(numSamples), 0},
+			[&model, &opt, &loader]() {
+				for (const std::vector<num::Tensor<double>>& batch : loader) {
+					opt.zeroGradient();
+					num::Tensor<double> zPred = model.forward(batch[0]);
+					num::Tensor<double> loss = autofn::sum<double>(autofn::mseLoss<double>(zPred, batch[1]));
+					loss.backward();
+					opt.step();
+				}
+			});
+	}
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	bench::Options options;
+	std::string outPath;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			std::cerr << "missing value for " << arg << std::endl;
+			return 1;
+		}
+		std::string val = argv[++i];
+		if (arg == "--filter") {
+			options.filter = val;
+		} else if (arg == "--min-time") {
+			options.minSeconds = std::stod(val);
+		} else if (arg == "--threads") {
+			num::setNumThreads(std::stoi(val));
+		} else if (arg == "--out") {
+			outPath = val;
+		} else {
+			std::cerr << "unknown option " << arg << std::endl;
+			return 1;
+		}
+	}
+
+	bench::Suite suite(options);
+	benchConstruction(suite);
+	benchBroadcast(suite);
+	benchMatMul(suite);
+	benchBackward(suite);
+	benchAdam(suite);
+	benchTraining(suite);
+
+	std::vector<std::pair<std::string, std::string>> context = {
+		{"commit", BENCH_GIT_COMMIT},
+		{"compiler", __VERSION__},
+		{"threads", std::to_string(num::numThreads())}
+	};
+	if (outPath.empty()) {
+		suite.writeJson(std::cout, context);
+	} else {
+		std::ofstream out(outPath);
+		suite.writeJson(out, context);
+		if (!out) {
+			std::cerr << "can't write " << outPath << std::endl;
+			return 1;
+		}
+	}
+}
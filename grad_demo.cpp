@@ -6,6 +6,9 @@ int main()
 {
 	num::Tensor<double> a(-4);
 	num::Tensor<double> b(2);
+	// only Tensors that require a gradient get one in backward()
+	a.setRequiresGrad();
+	b.setRequiresGrad();
 	num::Tensor<double> c = a + b;
 	
 	num::Tensor<double> d = a * b + autofn::pow<double>(b, 3);
@@ -8,13 +8,13 @@ template <num::num_t T>
 class RegressionModel : public nn::Module<T, RegressionModel<T>> {
 public:
 	RegressionModel()
-	: linLayer1 (this->registerModule(nn::Linear<T>(2, 10))),
+	: linLayer1 (this->registerModule(nn::Linear<T>(2, 10, true, autofn::Activation::relu))),
 	  linLayer2 (this->registerModule(nn::Linear<T>(10, 1, false)))
 	{}
 
 	num::Tensor<T> forward(const num::Tensor<T>& x) const
 	{
-		num::Tensor<T> out = autofn::relu<T>(linLayer1.forward(x));
+		num::Tensor<T> out = linLayer1.forward(x);
 		return linLayer2.forward(out);
 	}
 private:
@@ -25,7 +25,9 @@ private:
 int main()
 {
 	RegressionModel<double> regModel;
-	optim::Adam<double> opt(regModel.parameters, 0.1);
+	// one buffer for all parameters so that Adam updates them in one pass
+	regModel.flattenParameters();
+	optim::Adam<double> opt({regModel.flatParameter()}, 0.1);
 
 	num::Tensor<double> trainingData = num::randUniform<double>({1000, 2}, -5, 5);
 	std::cout << "training data: " << trainingData.toString() << std::endl;
@@ -80,43 +82,35 @@ int main()
 	int batchSize = 50;
 	int epochs = 30;
 
+	// targets z = x^2 + y^2 of every sample
+	num::Tensor<double> trainingTargets = autofn::pow<double>(trainingData.get({num::Slice{}, 0}), 2) +
+			autofn::pow<double>(trainingData.get({num::Slice{}, 1}), 2);
+	data::DataLoader<double> loader({trainingData, trainingTargets}, {.batchSize = batchSize});
 
 	for (int i = 0; i < epochs; i++) {
 
-		// first way to loop over Tensor
-		for (int j = 0; j < trainingData.dims[0]; j+=batchSize) {
+		// shuffled batches gathered on a background thread
+		for (const std::vector<num::Tensor<double>>& batch : loader) {
 			opt.zeroGradient();
-			trainingData
-				.get({num::Slice{j, j+batchSize, std::nullopt}})
-				.iter([&regModel, &trainingData, &opt](const auto& idx, const auto& el) {
-					num::Tensor<double> z = autofn::pow<double>(el.get({0,0}),2) +
-							autofn::pow<double>(el.get({0,1}), 2);
-
-					num::Tensor<double> zPred = regModel.forward(el);
-
-					num::Tensor<double> loss = autofn::mseLoss<double>(zPred, z);
-					loss.backward();
-				});
+			num::Tensor<double> zPred = regModel.forward(batch[0]);
+			num::Tensor<double> loss = autofn::sum<double>(autofn::mseLoss<double>(zPred, batch[1]));
+			loss.backward();
 			opt.step();
-
 		}
 		
-		num::Tensor<double> valLossTotal(0);
-		// another way to loop over Tensor
-		for (int j = 0; j < validationData.dims[0]; j++) {
-			num::Tensor<double> z = autofn::pow<double>(validationData.get({j,0}),2) +
-					autofn::pow<double>(validationData.get({j,1}), 2);
-
-			num::Tensor<double> zPred = regModel.forward(validationData.get({j}));
-
-			valLossTotal = valLossTotal + autofn::mseLoss<double>(zPred, z);
-		}
-		valLossTotal = valLossTotal / num::Tensor<double>(validationData.dims[0]);
-		std::cout << "Epoch " << i << " average validation loss: " << valLossTotal.get({0}).toString() << std::endl;
+		// validation doesn't need the autograd graph
+		autofn::NoGradGuard noGrad;
+		// the whole validation set as one batch
+		num::Tensor<double> z = autofn::pow<double>(validationData.get({num::Slice{}, 0}), 2) +
+				autofn::pow<double>(validationData.get({num::Slice{}, 1}), 2);
+		num::Tensor<double> zPred = regModel.forward(validationData);
+		num::Tensor<double> valLoss = autofn::mean<double>(autofn::mseLoss<double>(zPred, z));
+		std::cout << "Epoch " << i << " average validation loss: " << valLoss.toString() << std::endl;
 	}
 
 	zPredV.clear();
 	std::cout << "before computing prediction" << std::endl;
+	autofn::NoGradGuard noGrad;
 	for (double x = -5; x < 5; x+=0.1) {
 		for (double y = -5; y < 5; y+=0.1) {
 			modelInput.setSingle(x, {0,0});
@@ -0,0 +1,103 @@
+#include <cmath>
+#include <iostream>
+#include <string>
+
+#include "autograd/autograd.h"
+
+// Checks that bfloat16 Tensors accumulate in acc_t<bfloat16> (float)
+// and only round final results, run it with ctest.
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+	if (!ok) {
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+/// A·B for K larger than one block of K of the GEMM kernel,
+/// compared to the same product in double rounded once
+void testGemmLongK()
+{
+	using num::bfloat16;
+	for (int K : {2048, 1000}) {
+		int M = 40;
+		int N = 48;
+		num::Tensor<bfloat16> a = num::randUniform<bfloat16>({M, K}, -1, 1);
+		num::Tensor<bfloat16> b = num::randUniform<bfloat16>({K, N}, -1, 1);
+		num::Tensor<bfloat16> ones = num::ones<bfloat16>({M, K});
+		num::Tensor<bfloat16> point3({K, N}, [](const num::IntArrRef&) {return bfloat16(0.3f);});
+
+		autofn::NoGradGuard noGrad;
+		num::Tensor<bfloat16> c = autofn::mm<bfloat16>(a, b);
+		num::Tensor<bfloat16> constant = autofn::mm<bfloat16>(ones, point3);
+		for (int i = 0; i < M; ++i) {
+			for (int j = 0; j < N; ++j) {
+				double ref = 0;
+				for (int p = 0; p < K; ++p) {
+					ref += double(float(a.getSingle({i, p}))) * double(float(b.getSingle({p, j})));
+				}
+				// float accumulation error stays far below one bfloat16 ulp
+				double tolerance = std::abs(ref) / 128 + 1e-2;
+				double got = float(c.getSingle({i, j}));
+				check(std::abs(got - ref) <= tolerance, "mm K=" + std::to_string(K) + " at " +
+					std::to_string(i) + "," + std::to_string(j) + ": " + std::to_string(got) + " vs " + std::to_string(ref));
+			}
+		}
+		double exact = float(bfloat16(0.3f)) * double(K);
+		check(float(constant.getSingle({0, 0})) == float(bfloat16(exact)),
+			"ones x 0.3 with K=" + std::to_string(K) + ": " + std::to_string(float(constant.getSingle({0, 0}))) +
+			" vs " + std::to_string(float(bfloat16(exact))));
+	}
+}
+
+/// the bias gradient of a Linear layer sums a row of the gradient per sample
+void testLinearBiasGradient()
+{
+	using num::bfloat16;
+	int N = 2048;
+	num::Tensor<bfloat16> x = num::ones<bfloat16>({N, 3});
+	num::Tensor<bfloat16> w = num::ones<bfloat16>({2, 3});
+	num::Tensor<bfloat16> b = num::zeros<bfloat16>({2});
+	b.setRequiresGrad();
+	autofn::sum<bfloat16>(autofn::linear<bfloat16>(x, w, b)).backward();
+	for (int j = 0; j < 2; ++j) {
+		float got = b.getGradient().getSingle({j});
+		check(got == N, "bias gradient " + std::to_string(got) + " vs " + std::to_string(N));
+	}
+}
+
+/// indices above 256 aren't representable in bfloat16
+void testArgmaxLargeIndex()
+{
+	using num::bfloat16;
+	num::Tensor<bfloat16> x = num::zeros<bfloat16>({1000});
+	x.data()[777] = 1;
+	x.data()[333] = -1;
+	check(autofn::argmax<bfloat16>(x).getSingle({0}) == 777, "argmax of 1000 elements");
+	check(autofn::argmin<bfloat16>(x).getSingle({0}) == 333, "argmin of 1000 elements");
+
+	num::Tensor<bfloat16> rows = num::zeros<bfloat16>({2, 600});
+	rows.data()[599] = 1;
+	rows.data()[600 + 301] = 1;
+	num::Tensor<float> perRow = autofn::argmax<bfloat16>(rows, 1);
+	check(perRow.getSingle({0}) == 599 && perRow.getSingle({1}) == 301, "argmax along an axis");
+}
+
+} // namespace
+
+int main()
+{
+	testGemmLongK();
+	testLinearBiasGradient();
+	testArgmaxLargeIndex();
+	if (failures > 0) {
+		std::cerr << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "all checks passed" << std::endl;
+}